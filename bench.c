@@ -0,0 +1,362 @@
+/*
+ * Standalone microbenchmark of the queue operations.
+ *
+ * Links queue.o directly, without the checking harness or its time limit,
+ * and prints one CSV line per operation, element count, string length and
+ * input distribution.
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Our program needs to use regular malloc/free */
+#define INTERNAL 1
+#include "harness.h"
+
+#include "perf.h"
+#include "queue.h"
+#include "random.h"
+
+/* Number of q_delete_mid calls timed on each queue */
+#define DELETE_MID_OPS 100
+
+/* Number of distinct strings in the many-duplicates distribution */
+#define DUP_POOL 16
+
+/* queue.o is built against the harness, hand its allocations to libc */
+void *test_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+void *test_calloc(size_t nelem, size_t elsize)
+{
+    return calloc(nelem, elsize);
+}
+
+void *test_realloc(void *p, size_t size)
+{
+    return realloc(p, size);
+}
+
+void test_free(void *p)
+{
+    free(p);
+}
+
+char *test_strdup(const char *s)
+{
+    return strdup(s);
+}
+
+void set_alloc_site(const char *file, int line) {}
+
+typedef enum { DIST_RANDOM, DIST_SORTED, DIST_REVERSED, DIST_DUPS } dist_t;
+
+static const char *dist_names[] = {"random", "sorted", "reversed", "dups"};
+
+static const char *sort_names[] = {"sort_merge", "sort_prefix", "sort_radix",
+                                   "sort_parallel"};
+
+static int lengths[] = {8, 32};
+
+static int reps = 3;
+
+/* Whether hardware counters are read around every measurement */
+static bool use_perf = false;
+static perf_sample_t sample;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static double start_clock()
+{
+    if (use_perf)
+        perf_start();
+    return now();
+}
+
+static double stop_clock()
+{
+    double t = now();
+    if (use_perf)
+        perf_stop(&sample);
+    return t;
+}
+
+static void random_string(char *s, int len)
+{
+    for (int i = 0; i < len; i++)
+        s[i] = 'a' + prng_below(26);
+    s[len] = '\0';
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+typedef struct {
+    char **s;
+    char *buf;
+} input_t;
+
+/* Return n strings of len characters following distribution d */
+static input_t make_input(int n, int len, dist_t d)
+{
+    char **s = malloc(n * sizeof(char *));
+    char *buf = malloc((size_t) n * (len + 1));
+    if (!s || !buf) {
+        fprintf(stderr, "Could not allocate input of %d strings\n", n);
+        exit(1);
+    }
+
+    for (int i = 0; i < n; i++) {
+        s[i] = buf + (size_t) i * (len + 1);
+        if (d == DIST_DUPS && i >= DUP_POOL)
+            strcpy(s[i], s[prng_below(DUP_POOL)]);
+        else
+            random_string(s[i], len);
+    }
+
+    if (d == DIST_SORTED || d == DIST_REVERSED)
+        qsort(s, n, sizeof(char *), cmp_str);
+    if (d == DIST_REVERSED) {
+        for (int i = 0, j = n - 1; i < j; i++, j--) {
+            char *t = s[i];
+            s[i] = s[j];
+            s[j] = t;
+        }
+    }
+    return (input_t){.s = s, .buf = buf};
+}
+
+static void free_input(input_t in)
+{
+    free(in.s);
+    free(in.buf);
+}
+
+static struct list_head *fill(char **s, int n)
+{
+    struct list_head *q = q_new();
+    if (!q || q_insert_tail_batch(q, s, n) != n) {
+        fprintf(stderr, "Could not build queue of %d elements\n", n);
+        exit(1);
+    }
+    return q;
+}
+
+typedef enum {
+    OP_INSERT_HEAD,
+    OP_INSERT_TAIL,
+    OP_REMOVE_HEAD,
+    OP_REVERSE,
+    OP_SWAP,
+    OP_SORT,
+    OP_DELETE_DUP,
+    OP_DEDUP_HASH,
+    OP_DELETE_MID,
+    OP_DELETE_MID_INDEX,
+} op_t;
+
+/*
+ * Run op once on a queue built from the n strings of s.
+ * Return the time taken and store the number of operations done in *ops.
+ */
+static double run_op(op_t op, int engine, char **s, int n, int len, long *ops)
+{
+    struct list_head *q = NULL;
+    double start, end;
+    *ops = n;
+
+    switch (op) {
+    case OP_INSERT_HEAD:
+    case OP_INSERT_TAIL:
+        q = q_new();
+        start = start_clock();
+        for (int i = 0; i < n; i++) {
+            if (op == OP_INSERT_HEAD)
+                q_insert_head(q, s[i]);
+            else
+                q_insert_tail(q, s[i]);
+        }
+        end = stop_clock();
+        break;
+    case OP_REMOVE_HEAD: {
+        char buf[64];
+        q = fill(s, n);
+        start = start_clock();
+        for (int i = 0; i < n; i++)
+            q_release_element(q_remove_head(q, buf, len + 1));
+        end = stop_clock();
+        break;
+    }
+    case OP_REVERSE:
+        q = fill(s, n);
+        start = start_clock();
+        q_reverse(q);
+        end = stop_clock();
+        break;
+    case OP_SWAP:
+        q = fill(s, n);
+        start = start_clock();
+        q_swap(q);
+        end = stop_clock();
+        break;
+    case OP_SORT:
+        q = fill(s, n);
+        q_sort_engine(engine);
+        start = start_clock();
+        q_sort(q);
+        end = stop_clock();
+        q_sort_engine(SORT_MERGE);
+        break;
+    case OP_DELETE_DUP:
+        q = fill(s, n);
+        q_sort(q);
+        start = start_clock();
+        q_delete_dup(q);
+        end = stop_clock();
+        break;
+    case OP_DEDUP_HASH:
+        q = fill(s, n);
+        start = start_clock();
+        q_delete_dup_unsorted(q);
+        end = stop_clock();
+        break;
+    case OP_DELETE_MID:
+    case OP_DELETE_MID_INDEX:
+        q = fill(s, n);
+        *ops = n < DELETE_MID_OPS ? n : DELETE_MID_OPS;
+        /* Indexed, the loop is cheap enough to drain half the queue */
+        if (op == OP_DELETE_MID_INDEX) {
+            q_index(q);
+            *ops = n / 2;
+        }
+        start = start_clock();
+        for (long i = 0; i < *ops; i++)
+            q_delete_mid(q);
+        end = stop_clock();
+        break;
+    default:
+        return 0;
+    }
+
+    q_free(q);
+    return end - start;
+}
+
+static const char *op_name(op_t op, int engine)
+{
+    static const char *names[] = {
+        [OP_INSERT_HEAD] = "insert_head", [OP_INSERT_TAIL] = "insert_tail",
+        [OP_REMOVE_HEAD] = "remove_head", [OP_REVERSE] = "reverse",
+        [OP_SWAP] = "swap",               [OP_DELETE_DUP] = "delete_dup",
+        [OP_DEDUP_HASH] = "dedup_hash",   [OP_DELETE_MID] = "delete_mid",
+        [OP_DELETE_MID_INDEX] = "delete_mid_index",
+    };
+    return op == OP_SORT ? sort_names[engine] : names[op];
+}
+
+/* Time op over reps runs and print its best result */
+static void bench(op_t op, int engine, int n, int len, dist_t d)
+{
+    double best = 0;
+    long ops = 0;
+    perf_sample_t best_sample;
+    for (int r = 0; r < reps; r++) {
+        input_t in = make_input(n, len, d);
+        double t = run_op(op, engine, in.s, n, len, &ops);
+        free_input(in);
+        if (!r || t < best) {
+            best = t;
+            best_sample = sample;
+        }
+    }
+
+    double ns = ops ? best * 1e9 / ops : 0;
+    printf("%s,%d,%d,%s,%.2f,%.0f", op_name(op, engine), n, len,
+           dist_names[d], ns, ns > 0 ? 1e9 / ns : 0.0);
+    /* Counters per operation, left empty when unavailable */
+    for (int i = 0; use_perf && i < PERF_NR_COUNTERS; i++) {
+        if (best_sample.valid[i] && ops)
+            printf(",%.2f", (double) best_sample.value[i] / ops);
+        else
+            printf(",");
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static void usage(char *cmd)
+{
+    printf("Usage: %s [-h] [-p] [-m MAX] [-r REPS] [-s SEED]\n", cmd);
+    printf("\t-h\tPrint this information\n");
+    printf("\t-p\tAlso report hardware performance counters per op\n");
+    printf("\t-m MAX\tLargest element count, counts go up tenfold from 1000 "
+           "(default: 1000000)\n");
+    printf("\t-r REPS\tRuns per measurement, the best one is kept "
+           "(default: 3)\n");
+    printf("\t-s SEED\tSeed of the string generator (default: 1)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    long max = 1000000;
+    uint64_t seed = 1;
+    int c;
+    while ((c = getopt(argc, argv, "hpm:r:s:")) != -1) {
+        switch (c) {
+        case 'm':
+            max = atol(optarg);
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'p':
+            use_perf = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (reps < 1)
+        reps = 1;
+
+    if (use_perf && !perf_open())
+        fprintf(stderr, "Hardware performance counters are not available\n");
+
+    prng_seed(seed);
+    printf("op,count,length,distribution,ns_per_op,ops_per_sec");
+    for (int i = 0; use_perf && i < PERF_NR_COUNTERS; i++)
+        printf(",%s_per_op", perf_name(i));
+    printf("\n");
+    for (long n = 1000; n <= max; n *= 10) {
+        for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            for (dist_t d = DIST_RANDOM; d <= DIST_DUPS; d++) {
+                for (op_t op = OP_INSERT_HEAD; op <= OP_DELETE_MID_INDEX; op++) {
+                    int engines = op == OP_SORT ? SORT_PARALLEL + 1 : 1;
+                    for (int e = 0; e < engines; e++)
+                        bench(op, e, (int) n, lengths[l], d);
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -7,14 +7,18 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "perf.h"
 #include "report.h"
 #include "tiny.h"
 
@@ -60,6 +64,24 @@ static int fd_max = 0;
 static int err_limit = 5;
 static int err_cnt = 0;
 static int echo = 0;
+static int latency_mode = 0;
+static int perf_mode = 0;
+
+/*
+ * Log-bucketed latency histogram, in nanoseconds.  Every power of two is
+ * split into HIST_SUB linear sub-buckets, so that a recorded value is off
+ * by at most 1 / HIST_SUB of itself while the whole range of uint64_t fits
+ * in HIST_BUCKETS counters.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct latency_hist {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} latency_hist_t;
 
 static bool quit_flag = false;
 static char *prompt = "cmd> ";
@@ -79,9 +101,35 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/*
+ * Commands are also kept in an open-addressing table hashed on their name,
+ * for lookups that do not have to walk the sorted list.  Keeping it at most
+ * half full bounds the probe sequences.
+ */
+#define CMD_TABLE_SIZE 256
+static cmd_ptr cmd_table[CMD_TABLE_SIZE];
+static int cmd_cnt = 0;
+
+/* Return the slot of the command called name, or the empty one to put it */
+static cmd_ptr *cmd_slot(const char *name)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
+    for (const char *c = name; *c; c++)
+        h = (h ^ (unsigned char) *c) * 16777619u;
+
+    uint32_t i = h & (CMD_TABLE_SIZE - 1);
+    while (cmd_table[i] && strcmp(cmd_table[i]->name, name))
+        i = (i + 1) & (CMD_TABLE_SIZE - 1);
+    return &cmd_table[i];
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_function operation, char *documentation)
 {
+    if (cmd_cnt >= CMD_TABLE_SIZE / 2)
+        report_event(MSG_FATAL, "Exceeded limit on commands");
+
     cmd_ptr next_cmd = cmd_list;
     cmd_ptr *last_loc = &cmd_list;
     while (next_cmd && strcmp(name, next_cmd->name) > 0) {
@@ -93,8 +141,15 @@ void add_cmd(char *name, cmd_function operation, char *documentation)
     ele->name = name;
     ele->operation = operation;
     ele->documentation = documentation;
+    ele->latency = NULL;
     ele->next = next_cmd;
     *last_loc = ele;
+
+    /* A command added again under the same name takes over lookups */
+    cmd_ptr *slot = cmd_slot(name);
+    if (!*slot)
+        cmd_cnt++;
+    *slot = ele;
 }
 
 /* Add a new parameter */
@@ -174,18 +229,75 @@ static void record_error()
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[])
+static int hist_index(uint64_t v)
+{
+    if (v < HIST_SUB)
+        return (int) v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int) ((v >> shift) - HIST_SUB);
+}
+
+/* Smallest value falling into bucket i */
+static uint64_t hist_value(int i)
+{
+    if (i < HIST_SUB)
+        return (uint64_t) i;
+    int shift = i / HIST_SUB - 1;
+    return (uint64_t) (HIST_SUB + i % HIST_SUB) << shift;
+}
+
+static void record_latency(cmd_ptr cmd, uint64_t ns)
+{
+    if (!cmd->latency) {
+        cmd->latency = calloc_or_fail(1, sizeof(latency_hist_t), "latency");
+        if (!cmd->latency)
+            return;
+    }
+
+    latency_hist_t *h = cmd->latency;
+    h->count++;
+    if (ns > h->max)
+        h->max = ns;
+    h->buckets[hist_index(ns)]++;
+}
+
+/* Highest value of the bucket holding the given fraction of the samples */
+static uint64_t hist_percentile(const latency_hist_t *h, double fraction)
+{
+    uint64_t rank = (uint64_t) (fraction * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t v = i + 1 < HIST_BUCKETS ? hist_value(i + 1) - 1 : h->max;
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* Run command next_cmd on its arguments, NULL meaning it is unknown */
+static bool run_cmd(cmd_ptr next_cmd, int argc, char *argv[])
 {
-    if (argc == 0)
-        return true;
-    /* Try to find matching command */
-    cmd_ptr next_cmd = cmd_list;
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
-        ok = next_cmd->operation(argc, argv);
+        if (latency_mode) {
+            uint64_t start = now_ns();
+            ok = next_cmd->operation(argc, argv);
+            record_latency(next_cmd, now_ns() - start);
+        } else {
+            ok = next_cmd->operation(argc, argv);
+        }
         if (!ok)
             record_error();
     } else {
@@ -197,6 +309,14 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
+/* Execute a command that has already been split into arguments */
+static bool interpret_cmda(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+    return run_cmd(*cmd_slot(argv[0]), argc, argv);
+}
+
 /* Execute a command from a command line */
 static bool interpret_cmd(char *cmdline)
 {
@@ -239,8 +359,13 @@ static bool do_quit(int argc, char *argv[])
     while (c) {
         cmd_ptr ele = c;
         c = c->next;
+        if (ele->latency)
+            free_block(ele->latency, sizeof(latency_hist_t));
         free_block(ele, sizeof(cmd_ele));
     }
+    cmd_list = NULL;
+    memset(cmd_table, 0, sizeof(cmd_table));
+    cmd_cnt = 0;
 
     param_ptr p = param_list;
     while (p) {
@@ -366,6 +491,16 @@ static bool do_source(int argc, char *argv[])
     return true;
 }
 
+static bool do_run(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "No source file given");
+        return false;
+    }
+
+    return run_compiled(argv[1]);
+}
+
 static bool do_log(int argc, char *argv[])
 {
     if (argc < 2) {
@@ -380,6 +515,35 @@ static bool do_log(int argc, char *argv[])
     return result;
 }
 
+static void set_perf(int oldval)
+{
+    if (!perf_mode) {
+        perf_close();
+        return;
+    }
+
+    if (!perf_available() && !perf_open()) {
+        report(1, "Hardware performance counters are not available");
+        perf_mode = 0;
+    }
+}
+
+static void report_counters(const perf_sample_t *s)
+{
+    char buf[MAX_CHAR];
+    int len = 0;
+    for (int i = 0; i < PERF_NR_COUNTERS; i++) {
+        const char *sep = i ? ", " : "";
+        if (s->valid[i])
+            len += snprintf(buf + len, sizeof(buf) - len, "%s%s = %" PRIu64,
+                            sep, perf_name(i), s->value[i]);
+        else
+            len += snprintf(buf + len, sizeof(buf) - len, "%s%s = n/a", sep,
+                            perf_name(i));
+    }
+    report(1, "%s", buf);
+}
+
 static bool do_time(int argc, char *argv[])
 {
     double delta = delta_time(&last_time);
@@ -388,18 +552,54 @@ static bool do_time(int argc, char *argv[])
         double elapsed = last_time - first_time;
         report(1, "Elapsed time = %.3f, Delta time = %.3f", elapsed, delta);
     } else {
+        perf_sample_t sample;
+        if (perf_mode)
+            perf_start();
         ok = interpret_cmda(argc - 1, argv + 1);
+        if (perf_mode)
+            perf_stop(&sample);
         if (block_flag) {
             block_timing = true;
         } else {
             delta = delta_time(&last_time);
             report(1, "Delta time = %.3f", delta);
+            if (perf_mode)
+                report_counters(&sample);
         }
     }
 
     return ok;
 }
 
+static bool do_stats(int argc, char *argv[])
+{
+    bool reset = argc == 2 && !strcmp(argv[1], "reset");
+    if (argc > 2 || (argc == 2 && !reset)) {
+        report(1, "Usage: %s [reset]", argv[0]);
+        return false;
+    }
+
+    if (!latency_mode && !reset)
+        report(3, "Warning: Latencies are not recorded, see option latency");
+    if (!reset)
+        report(1, "%-12s %10s %12s %12s %12s %12s", "command", "count",
+               "p50 (us)", "p99 (us)", "p99.9 (us)", "max (us)");
+    for (cmd_ptr c = cmd_list; c; c = c->next) {
+        latency_hist_t *h = c->latency;
+        if (!h || !h->count)
+            continue;
+        if (reset) {
+            memset(h, 0, sizeof(latency_hist_t));
+            continue;
+        }
+        report(1, "%-12s %10" PRIu64 " %12.3f %12.3f %12.3f %12.3f", c->name,
+               h->count, hist_percentile(h, 0.5) / 1e3,
+               hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3,
+               h->max / 1e3);
+    }
+    return true;
+}
+
 static bool do_web_cmd(int argc, char *argv[])
 {
     int port = DEFAULT_PORT;
@@ -419,6 +619,12 @@ static bool do_web_cmd(int argc, char *argv[])
     }
     int flags = fcntl(listenfd, F_GETFL);
     fcntl(listenfd, F_SETFL, flags | O_NONBLOCK);
+    if (!web_init(listenfd)) {
+        report(1, "Fail to set up web connections");
+        close(listenfd);
+        listenfd = -1;
+        return false;
+    }
     noise = false;
     return true;
 }
@@ -435,14 +641,24 @@ void init_cmd()
     ADD_COMMAND(option, " [name val]     | Display or set options");
     ADD_COMMAND(quit, "                | Exit program");
     ADD_COMMAND(source, " file           | Read commands from source file");
+    ADD_COMMAND(run,
+                " file           | Read commands from file, compiled up front");
     ADD_COMMAND(log, " file           | Copy output to file");
     ADD_COMMAND(time, " cmd arg ...    | Time command execution");
+    ADD_COMMAND(stats,
+                " [reset]        | Show latency percentiles of every command, "
+                "or forget them");
     ADD_COMMAND(web_cmd, " [port]         | Run web server");
     add_cmd("#", do_comment_cmd, " ...            | Display comment");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
+    add_param("latency", &latency_mode,
+              "Record the latency of every command, see command stats", NULL);
+    add_param("perf", &perf_mode,
+              "Show hardware performance counters of timed commands",
+              set_perf);
 
     init_in();
     init_time(&last_time);
@@ -552,6 +768,31 @@ static bool cmd_done()
     return !buf_stack || quit_flag;
 }
 
+/*
+ * Run the newline separated commands of a web batch back to back, answering
+ * with the outcome of each, followed by the command itself.
+ */
+static void run_batch(int conn, char *cmds)
+{
+    web_begin_chunked(conn);
+    char *next;
+    for (char *line = cmds; line && !quit_flag; line = next) {
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+        size_t len = strlen(line);
+        if (len && line[len - 1] == '\r')
+            line[--len] = '\0';
+        if (!len)
+            continue;
+
+        bool ok = interpret_cmd(line);
+        web_write(conn, ok ? "ok " : "error ", ok ? 3 : 6);
+        web_write(conn, line, len);
+        web_write(conn, "\n", 1);
+    }
+}
+
 /*
  * Handle command processing in program that uses select as main control loop.
  * Like select, but checks whether command input either present in internal
@@ -570,6 +811,7 @@ int cmd_select(int nfds,
 {
     int infd;
     fd_set local_readset;
+    struct timeval no_wait = {0, 0};
 
     if (cmd_done())
         return 0;
@@ -584,9 +826,8 @@ int cmd_select(int nfds,
         FD_ZERO(readfds);
         FD_SET(infd, readfds);
 
-        /* If web not ready listen */
-        if (listenfd != -1)
-            FD_SET(listenfd, readfds);
+        /* Wait for new web connections and requests on open ones */
+        int webfd = listenfd != -1 ? web_fdset(readfds) : -1;
         if (infd == STDIN_FILENO && prompt_flag) {
             printf("%s", prompt);
             fflush(stdout);
@@ -595,14 +836,23 @@ int cmd_select(int nfds,
 
         if (infd >= nfds)
             nfds = infd + 1;
-        if (listenfd >= nfds)
-            nfds = listenfd + 1;
+        if (webfd >= nfds)
+            nfds = webfd + 1;
+
+        /* Queued up requests are served without waiting for more input */
+        if (listenfd != -1 && web_pending())
+            timeout = &no_wait;
     }
     if (nfds == 0)
         return 0;
 
+    /* Output must not wait behind a select that may block */
+    if (timeout != &no_wait &&
+        (buf_stack->fd == STDIN_FILENO || listenfd != -1))
+        report_flush();
+
     int result = select(nfds, readfds, writefds, exceptfds, timeout);
-    if (result <= 0)
+    if (result < 0 || (result == 0 && timeout != &no_wait))
         return result;
 
     infd = buf_stack->fd;
@@ -614,19 +864,24 @@ int cmd_select(int nfds,
         cmdline = readline();
         if (cmdline)
             interpret_cmd(cmdline);
-    } else if (readfds && FD_ISSET(listenfd, readfds)) {
-        FD_CLR(listenfd, readfds);
-        result--;
-        int connfd;
-        struct sockaddr_in clientaddr;
-        socklen_t clientlen = sizeof(clientaddr);
-        connfd = accept(listenfd, (SA *) &clientaddr, &clientlen);
-
-        char *p = process(connfd, &clientaddr);
-        if (p)
-            interpret_cmd(p);
-        free(p);
-        close(connfd);
+    }
+    if (listenfd != -1 && readfds) {
+        web_poll(readfds);
+        /*
+         * Connections take turns, and a bounded number of requests is
+         * served before the command line is looked at again.
+         */
+        int served = 0, conn;
+        bool batch;
+        char *p;
+        while (served++ < WEB_MAX_CONNS && (p = web_next(&conn, &batch))) {
+            if (batch)
+                run_batch(conn, p);
+            else
+                interpret_cmd(p);
+            web_respond(conn);
+            free(p);
+        }
     }
     return result;
 }
@@ -681,6 +936,124 @@ void completion(const char *buf, linenoiseCompletions *lc)
     }
 }
 
+/*
+ * A command file compiled up front.  Every line is split into its
+ * arguments and its command resolved once, leaving only the calls to be
+ * made when it runs.  The arguments of all lines share a single array, and
+ * their text a single buffer.
+ */
+typedef struct {
+    cmd_ptr cmd; /* NULL if the command is unknown */
+    int argc;
+    char **argv;
+    const char *line; /* The line as written, for echoing */
+    int line_len;
+} compiled_cmd_t;
+
+typedef struct {
+    compiled_cmd_t *cmds;
+    size_t cmd_cnt, cmd_cap;
+    char **args;
+    size_t arg_cnt;
+    char *text;
+    size_t text_len;
+} program_t;
+
+static void compile(const char *src, size_t len, program_t *prog)
+{
+    /*
+     * Size every part for the worst case: a line per newline, an argument
+     * per two characters, and the arguments with their terminators taking
+     * at most one byte more than the source.
+     */
+    prog->cmd_cnt = 0;
+    prog->cmd_cap = 1;
+    for (const char *p = src; (p = memchr(p, '\n', src + len - p)); p++)
+        prog->cmd_cap++;
+    prog->arg_cnt = len / 2 + 1;
+    prog->text_len = len + 1;
+    prog->cmds =
+        malloc_or_fail(prog->cmd_cap * sizeof(compiled_cmd_t), "compile");
+    prog->args = malloc_or_fail(prog->arg_cnt * sizeof(char *), "compile");
+    prog->text = malloc_or_fail(prog->text_len, "compile");
+
+    char **arg = prog->args;
+    char *dst = prog->text;
+    const char *end = src + len;
+    for (const char *line = src; line < end;) {
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol)
+            eol = end;
+
+        compiled_cmd_t *cmd = &prog->cmds[prog->cmd_cnt++];
+        cmd->argc = 0;
+        cmd->argv = arg;
+        cmd->line = line;
+        cmd->line_len = eol - line;
+        for (const char *c = line; c < eol;) {
+            while (c < eol && isspace(*c))
+                c++;
+            if (c == eol)
+                break;
+            arg[cmd->argc++] = dst;
+            while (c < eol && !isspace(*c))
+                *dst++ = *c++;
+            *dst++ = '\0';
+        }
+        arg += cmd->argc;
+        cmd->cmd = cmd->argc ? *cmd_slot(cmd->argv[0]) : NULL;
+        line = eol + 1;
+    }
+}
+
+static void free_program(program_t *prog)
+{
+    free_array(prog->cmds, prog->cmd_cap, sizeof(compiled_cmd_t));
+    free_array(prog->args, prog->arg_cnt, sizeof(char *));
+    free_block(prog->text, prog->text_len);
+}
+
+bool run_compiled(char *fname)
+{
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        report(1, "Could not open source file '%s'", fname);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    size_t len = st.st_size;
+    const char *src = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)
+                          : "";
+    close(fd);
+    if (src == MAP_FAILED) {
+        report(1, "Could not map source file '%s'", fname);
+        return false;
+    }
+
+    program_t prog;
+    compile(src, len, &prog);
+
+    rio_ptr base = buf_stack;
+    for (size_t i = 0; i < prog.cmd_cnt && !quit_flag; i++) {
+        compiled_cmd_t *cmd = &prog.cmds[i];
+        if (echo)
+            report_noreturn(1, "%s%.*s\n", prompt, cmd->line_len, cmd->line);
+        if (cmd->argc)
+            run_cmd(cmd->cmd, cmd->argc, cmd->argv);
+        /* Commands read by source come before the next line */
+        while (buf_stack != base && !cmd_done())
+            cmd_select(0, NULL, NULL, NULL, NULL);
+    }
+
+    free_program(&prog);
+    if (len)
+        munmap((void *) src, len);
+    return true;
+}
+
 bool run_console(char *infile_name)
 {
     if (!push_file(infile_name)) {
@@ -690,8 +1063,11 @@ bool run_console(char *infile_name)
 
     if (!has_infile) {
         char *cmdline;
+        /* linenoise writes to the terminal directly */
+        report_flush();
         while (noise && (cmdline = linenoise(prompt)) != NULL) {
             interpret_cmd(cmdline);
+            report_flush();
             linenoiseHistoryAdd(cmdline);       /* Add to the history. */
             linenoiseHistorySave(HISTORY_FILE); /* Save the history on disk. */
             linenoiseFree(cmdline);
@@ -21,6 +21,8 @@ struct CELE {
     char *name;
     cmd_function operation;
     char *documentation;
+    /* Latencies of past invocations, allocated when first recorded */
+    struct latency_hist *latency;
     cmd_ptr next;
 };
 
@@ -79,6 +81,12 @@ int cmd_select(int nfds,
  */
 bool run_console(char *infile_name);
 
+/*
+ * Run the commands of file fname, compiled in a single pass beforehand.
+ * Return false if it cannot be read.
+ */
+bool run_compiled(char *fname);
+
 /* Callback function to complete command by linenoise */
 void completion(const char *buf, linenoiseCompletions *lc);
 
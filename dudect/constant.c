@@ -16,9 +16,11 @@
 const size_t chunk_size = 16;
 
 /* Number of measurements per test */
-const size_t n_measure = N_MEASURE;
+int n_measure = N_MEASURE;
 
-const int drop_size = 20;
+int drop_size = 20;
+
+int dudect_workers = 1;
 
 /* Maintain a queue independent from the qtest since
  * we do not want the test to affect the original functionality
@@ -50,7 +52,7 @@ char *get_random_string(void)
 void prepare_inputs(uint8_t *input_data, uint8_t *classes)
 {
     randombytes(input_data, n_measure * chunk_size);
-    for (size_t i = 0; i < n_measure; i++) {
+    for (int i = 0; i < n_measure; i++) {
         classes[i] = randombit();
         if (classes[i] == 0)
             memset(input_data + (size_t) i * chunk_size, 0, chunk_size);
@@ -73,12 +75,12 @@ void measure(int64_t *before_ticks,
 
     switch (mode) {
     case test_insert_head:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+        for (int i = drop_size; i < n_measure - drop_size; i++) {
             char *s = get_random_string();
             dut_new();
             dut_insert_head(
                 get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
+                *(uint16_t *) (input_data + (size_t) i * chunk_size) % 10000);
             before_ticks[i] = cpucycles();
             dut_insert_head(s, 1);
             after_ticks[i] = cpucycles();
@@ -86,12 +88,12 @@ void measure(int64_t *before_ticks,
         }
         break;
     case test_insert_tail:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+        for (int i = drop_size; i < n_measure - drop_size; i++) {
             char *s = get_random_string();
             dut_new();
             dut_insert_head(
                 get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
+                *(uint16_t *) (input_data + (size_t) i * chunk_size) % 10000);
             before_ticks[i] = cpucycles();
             dut_insert_tail(s, 1);
             after_ticks[i] = cpucycles();
@@ -99,11 +101,11 @@ void measure(int64_t *before_ticks,
         }
         break;
     case test_remove_head:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+        for (int i = drop_size; i < n_measure - drop_size; i++) {
             dut_new();
             dut_insert_head(
                 get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
+                *(uint16_t *) (input_data + (size_t) i * chunk_size) % 10000);
             before_ticks[i] = cpucycles();
             element_t *e = q_remove_head(l, NULL, 0);
             after_ticks[i] = cpucycles();
@@ -113,9 +115,10 @@ void measure(int64_t *before_ticks,
         }
         break;
     case test_remove_tail:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+        for (int i = drop_size; i < n_measure - drop_size; i++) {
             dut_new();
-            uint16_t size = *(uint16_t *) (input_data + i * chunk_size) % 10000;
+            uint16_t size =
+                *(uint16_t *) (input_data + (size_t) i * chunk_size) % 10000;
             if (size) {
                 dut_insert_head(get_random_string(), size - 1);
                 dut_insert_tail(get_random_string(), 1);
@@ -129,11 +132,11 @@ void measure(int64_t *before_ticks,
         }
         break;
     default:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+        for (int i = drop_size; i < n_measure - drop_size; i++) {
             dut_new();
             dut_insert_tail(
                 get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
+                *(uint16_t *) (input_data + (size_t) i * chunk_size) % 10000);
             before_ticks[i] = cpucycles();
             dut_size(1);
             after_ticks[i] = cpucycles();
@@ -26,6 +26,15 @@
 
 #define dut_free() ((void) (q_free(l)))
 
+/* Number of measurements per round */
+extern int n_measure;
+
+/* Number of measurements dropped at each end of a round */
+extern int drop_size;
+
+/* Number of processes measuring in parallel */
+extern int dudect_workers;
+
 void init_dut();
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
 void measure(int64_t *before_ticks,
@@ -24,15 +24,25 @@
  *
  *  - as long as any of the different test fails, the code will be deemed
  *    variable time.
+ *
+ *  - with dudect_workers above 1, the rounds are spread over forked worker
+ *    processes pinned to distinct CPUs.  Processes rather than threads,
+ *    since neither the harness nor the queue under test are thread-safe.
+ *    Every worker keeps its own t_ctx, and the parent merges them before
+ *    computing the verdict.
  */
 
+#define _GNU_SOURCE
 #include "fixture.h"
 #include <assert.h>
 #include <math.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include "../console.h"
 #include "../random.h"
 #include "constant.h"
@@ -41,9 +51,10 @@
 #define enough_measure 10000
 #define test_tries 10
 
-extern const int drop_size;
+/* Upper bound of dudect_workers */
+#define MAX_WORKERS 64
+
 extern const size_t chunk_size;
-extern const size_t n_measure;
 static t_ctx *t;
 
 /* threshold values for Welch's t-test */
@@ -61,20 +72,22 @@ static void differentiate(int64_t *exec_times,
                           const int64_t *before_ticks,
                           const int64_t *after_ticks)
 {
-    for (size_t i = 0; i < n_measure; i++)
+    for (int i = 0; i < n_measure; i++)
         exec_times[i] = after_ticks[i] - before_ticks[i];
 }
 
-static void update_statistics(const int64_t *exec_times, uint8_t *classes)
+static void update_statistics(t_ctx *ctx,
+                              const int64_t *exec_times,
+                              uint8_t *classes)
 {
-    for (size_t i = 0; i < n_measure; i++) {
+    for (int i = 0; i < n_measure; i++) {
         int64_t difference = exec_times[i];
         /* CPU cycle counter overflowed or dropped measurement */
         if (difference <= 0)
             continue;
 
         /* do a t-test on the execution time */
-        t_push(t, difference, classes[i]);
+        t_push(ctx, difference, classes[i]);
     }
 }
 
@@ -89,6 +102,7 @@ static bool report(void)
                (number_traces_max_t / 1e6),
                enough_measure - number_traces_max_t);
         printf("\033[A\033[2K");
+        fflush(stdout);
         return false;
     }
 
@@ -106,6 +120,7 @@ static bool report(void)
     printf("meas: %7.2lf M, max t: %+7.2f, max tau: %.2e, (5/tau)^2: %.2e.\n",
            (number_traces_max_t / 1e6), max_t, max_tau,
            (double) (5 * 5) / (double) (max_tau * max_tau));
+    fflush(stdout);
 
     /* Definitely not constant time */
     if (max_t > t_threshold_bananas)
@@ -119,7 +134,8 @@ static bool report(void)
     return true;
 }
 
-static bool doit(int mode)
+/* Run one round of measurements, adding them to ctx */
+static void measure_round(t_ctx *ctx, int mode)
 {
     int64_t *before_ticks = calloc(n_measure + 1, sizeof(int64_t));
     int64_t *after_ticks = calloc(n_measure + 1, sizeof(int64_t));
@@ -136,16 +152,107 @@ static bool doit(int mode)
 
     measure(before_ticks, after_ticks, input_data, mode);
     differentiate(exec_times, before_ticks, after_ticks);
-    update_statistics(exec_times, classes);
-    bool ret = report();
+    update_statistics(ctx, exec_times, classes);
 
     free(before_ticks);
     free(after_ticks);
     free(exec_times);
     free(classes);
     free(input_data);
+}
+
+static bool doit(int mode)
+{
+    measure_round(t, mode);
+    return report();
+}
+
+/* Pin the calling process to the n-th CPU it may run on, modulo their count */
+static void pin_cpu(int n)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed))
+        return;
+
+    int cnt = CPU_COUNT(&allowed);
+    if (cnt < 2)
+        return;
+    n %= cnt;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            sched_setaffinity(0, sizeof(set), &set);
+            return;
+        }
+    }
+}
+
+/*
+ * Spread rounds of measurements over dudect_workers processes, merge their
+ * statistics into t, then report on the whole.  The rounds of any worker
+ * that could not be started or did not deliver are run here instead.
+ */
+static bool doit_parallel(int mode, int rounds)
+{
+    int k = dudect_workers < MAX_WORKERS ? dudect_workers : MAX_WORKERS;
+    pid_t pids[MAX_WORKERS];
+    int fds[MAX_WORKERS];
+
+    /* Output still buffered must not be written again by the children */
+    fflush(stdout);
+    for (int i = 0; i < k; i++) {
+        int share = rounds / k + (i < rounds % k);
+        int pipefd[2];
+        pids[i] = -1;
+        fds[i] = -1;
+        if (pipe(pipefd))
+            continue;
+
+        /* Drawn here, so that every call hands the workers fresh seeds */
+        uint64_t seed = prng_next();
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            close(pipefd[0]);
+            pin_cpu(i);
+            prng_seed(seed);
+            t_ctx local;
+            t_init(&local);
+            for (int r = 0; r < share; r++)
+                measure_round(&local, mode);
+            ssize_t n = write(pipefd[1], &local, sizeof(local));
+            /* _exit() skips the stdio flush, keep what the worker printed */
+            fflush(stdout);
+            _exit(n == sizeof(local) ? 0 : 1);
+        }
+
+        close(pipefd[1]);
+        if (pids[i] < 0)
+            close(pipefd[0]);
+        else
+            fds[i] = pipefd[0];
+    }
+
+    for (int i = 0; i < k; i++) {
+        int share = rounds / k + (i < rounds % k);
+        t_ctx local;
+        bool ok = fds[i] >= 0 && read(fds[i], &local, sizeof(local)) ==
+                                     (ssize_t) sizeof(local);
+        if (fds[i] >= 0)
+            close(fds[i]);
+        if (pids[i] > 0)
+            waitpid(pids[i], NULL, 0);
+
+        if (ok) {
+            t_merge(t, &local);
+        } else {
+            for (int r = 0; r < share; r++)
+                measure_round(t, mode);
+        }
+    }
 
-    return ret;
+    return report();
 }
 
 static void init_once(void)
@@ -162,9 +269,13 @@ static bool TEST_CONST(char *text, int mode)
     for (int cnt = 0; cnt < test_tries; ++cnt) {
         printf("Testing %s...(%d/%d)\n", text, cnt, test_tries);
         init_once();
-        for (int i = 0; i < enough_measure / (n_measure - drop_size * 2) + 1;
-             ++i)
-            result = doit(mode);
+        int rounds = enough_measure / (n_measure - drop_size * 2) + 1;
+        if (dudect_workers > 1) {
+            result = doit_parallel(mode, rounds);
+        } else {
+            for (int i = 0; i < rounds; ++i)
+                result = doit(mode);
+        }
         if (result == true)
             break;
     }
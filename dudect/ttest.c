@@ -28,6 +28,25 @@ void t_push(t_ctx *ctx, double x, uint8_t class)
     ctx->m2[class] = ctx->m2[class] + delta * (x - ctx->mean[class]);
 }
 
+/* Fold the samples gathered in other into ctx, as if pushed there.
+ * This is the pairwise update of Chan et al. for combining the mean and
+ * sum of squared differences of two sample sets.
+ */
+void t_merge(t_ctx *ctx, const t_ctx *other)
+{
+    for (int class = 0; class < 2; class ++) {
+        double n = ctx->n[class] + other->n[class];
+        if (n == 0)
+            continue;
+
+        double delta = other->mean[class] - ctx->mean[class];
+        ctx->m2[class] += other->m2[class] +
+                          delta * delta * ctx->n[class] * other->n[class] / n;
+        ctx->mean[class] += delta * other->n[class] / n;
+        ctx->n[class] = n;
+    }
+}
+
 double t_compute(t_ctx *ctx)
 {
     double var[2] = {0.0, 0.0};
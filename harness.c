@@ -2,6 +2,7 @@
 
 #include <setjmp.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,6 +37,7 @@
 typedef struct BELE {
     struct BELE *next, *prev;
     size_t payload_size;
+    int site;            /* Call site for the allocation profiler */
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
@@ -44,6 +46,44 @@ typedef struct BELE {
 static block_ele_t *allocated = NULL;
 static size_t allocated_count = 0;
 
+/*
+ * Open-addressing hash set of the allocated blocks, so that cautious mode
+ * checks a block in constant time instead of scanning the list.  Freed
+ * entries become tombstones to keep probe sequences intact, and are dropped
+ * whenever the table is rebuilt.
+ */
+#define LIVE_MIN_CAPACITY 1024
+#define LIVE_TOMBSTONE ((block_ele_t *) 1)
+
+static block_ele_t **live_table = NULL;
+static size_t live_capacity = 0;
+/* Number of entries that are either allocated blocks or tombstones */
+static size_t live_used = 0;
+
+/*
+ * Freed blocks of up to POOL_MAX_SIZE bytes are recycled through one free
+ * list per size class instead of going back to the system.  Every freed
+ * block first waits in a FIFO quarantine so that it is not handed out again
+ * right away, and stays poisoned with FILLCHAR until it is reused, at which
+ * point the poison is verified to catch writes through dangling pointers.
+ * Larger blocks are verified and released when they leave the quarantine.
+ */
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+#define QUARANTINE_SIZE 256
+
+/* Free lists, linked through the next field of the blocks */
+static block_ele_t *pool[POOL_CLASSES];
+
+static block_ele_t *quarantine[QUARANTINE_SIZE];
+static size_t quarantine_head = 0;
+static size_t quarantine_count = 0;
+
+/* Call site of the allocation in progress, as set by set_alloc_site */
+static const char *site_file = NULL;
+static int site_line = 0;
+
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
@@ -72,6 +112,79 @@ static bool fail_allocation()
     return (weight < 0.01 * fail_probability);
 }
 
+static size_t live_hash(const block_ele_t *b)
+{
+    uint64_t x = (uintptr_t) b;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (size_t) x;
+}
+
+/* Return the slot holding b, or the empty slot ending its probe sequence */
+static size_t live_find(const block_ele_t *b)
+{
+    size_t mask = live_capacity - 1;
+    size_t i = live_hash(b) & mask;
+    while (live_table[i] && live_table[i] != b)
+        i = (i + 1) & mask;
+    return i;
+}
+
+/*
+ * Rebuild the table with room for about four times the allocated blocks.
+ * Return false if space could not be allocated.
+ */
+static bool live_rebuild(size_t count)
+{
+    size_t capacity = LIVE_MIN_CAPACITY;
+    while (capacity / 4 < count)
+        capacity <<= 1;
+
+    block_ele_t **old = live_table;
+    size_t old_capacity = live_capacity;
+    live_table = calloc(capacity, sizeof(block_ele_t *));
+    if (!live_table) {
+        live_table = old;
+        return false;
+    }
+    live_capacity = capacity;
+    live_used = 0;
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i] && old[i] != LIVE_TOMBSTONE) {
+            live_table[live_find(old[i])] = old[i];
+            live_used++;
+        }
+    }
+    free(old);
+    return true;
+}
+
+static bool live_insert(block_ele_t *b)
+{
+    if ((live_used + 1) * 2 > live_capacity &&
+        !live_rebuild(allocated_count + 1))
+        return false;
+    live_table[live_find(b)] = b;
+    live_used++;
+    return true;
+}
+
+static bool live_contains(const block_ele_t *b)
+{
+    return live_table && live_table[live_find(b)] == b;
+}
+
+static void live_remove(const block_ele_t *b)
+{
+    if (!live_table)
+        return;
+    size_t i = live_find(b);
+    if (live_table[i] == b)
+        live_table[i] = LIVE_TOMBSTONE;
+}
+
 /*
  * Find header of block, given its payload.
  * Signal error if doesn't seem like legitimate block
@@ -86,13 +199,7 @@ static block_ele_t *find_header(void *p)
     block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
     if (cautious_mode) {
         /* Make sure this is really an allocated block */
-        block_ele_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+        if (!live_contains(b)) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
@@ -119,24 +226,84 @@ static size_t *find_footer(block_ele_t *b)
     return p;
 }
 
-/*
- * Implementation of application functions
- */
-void *test_malloc(size_t size)
+static size_t pool_class(size_t size)
 {
-    if (noallocate_mode) {
-        report_event(MSG_FATAL, "Calls to malloc disallowed");
-        return NULL;
+    return size ? (size - 1) / POOL_GRANULE : 0;
+}
+
+/* Number of payload bytes actually backing a block of the given size */
+static size_t block_capacity(size_t size)
+{
+    if (size > POOL_MAX_SIZE)
+        return size;
+    return (pool_class(size) + 1) * POOL_GRANULE;
+}
+
+/* Make sure nothing was written to a freed block */
+static void check_poison(block_ele_t *b)
+{
+    bool intact = b->magic_header == MAGICFREE && *find_footer(b) == MAGICFREE;
+    for (size_t i = 0; intact && i < b->payload_size; i++)
+        intact = b->payload[i] == FILLCHAR;
+    if (!intact) {
+        report_event(MSG_ERROR,
+                     "Use after free detected in block with address %p",
+                     (void *) &b->payload);
+        error_occurred = true;
     }
+}
 
-    if (fail_allocation()) {
-        report_event(MSG_WARN, "Malloc returning NULL");
+/* Take a freed block of the size class of size, or NULL if there is none */
+static block_ele_t *pool_get(size_t size)
+{
+    if (size > POOL_MAX_SIZE)
         return NULL;
+
+    block_ele_t **list = &pool[pool_class(size)];
+    block_ele_t *b = *list;
+    if (b) {
+        *list = b->next;
+        check_poison(b);
+    }
+    return b;
+}
+
+static void pool_put(block_ele_t *b)
+{
+    if (b->payload_size > POOL_MAX_SIZE) {
+        check_poison(b);
+        free(b);
+        return;
     }
 
-    block_ele_t *new_block =
-        malloc(size + sizeof(block_ele_t) + sizeof(size_t));
-    if (!new_block) {
+    block_ele_t **list = &pool[pool_class(b->payload_size)];
+    b->next = *list;
+    *list = b;
+}
+
+/* Put a freed block in quarantine, pushing out the oldest one if full */
+static void quarantine_put(block_ele_t *b)
+{
+    if (quarantine_count < QUARANTINE_SIZE) {
+        size_t i = (quarantine_head + quarantine_count++) % QUARANTINE_SIZE;
+        quarantine[i] = b;
+        return;
+    }
+
+    block_ele_t *oldest = quarantine[quarantine_head];
+    quarantine[quarantine_head] = b;
+    quarantine_head = (quarantine_head + 1) % QUARANTINE_SIZE;
+    pool_put(oldest);
+}
+
+/* Set up a block of size bytes, recycling a pooled one if possible */
+static void *alloc_block(size_t size)
+{
+    block_ele_t *new_block = pool_get(size);
+    if (!new_block)
+        new_block =
+            malloc(block_capacity(size) + sizeof(block_ele_t) + sizeof(size_t));
+    if (!new_block || !live_insert(new_block)) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
     }
@@ -145,6 +312,8 @@ void *test_malloc(size_t size)
     new_block->magic_header = MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
+    new_block->site = profile_alloc(site_file, site_line, size);
+    site_file = NULL;
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, FILLCHAR, size);
@@ -161,18 +330,119 @@ void *test_malloc(size_t size)
     return p;
 }
 
+/*
+ * Implementation of application functions
+ */
+void set_alloc_site(const char *file, int line)
+{
+    site_file = file;
+    site_line = line;
+}
+
+void *test_malloc(size_t size)
+{
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to malloc disallowed");
+        return NULL;
+    }
+
+    if (fail_allocation()) {
+        report_event(MSG_WARN, "Malloc returning NULL");
+        return NULL;
+    }
+
+    return alloc_block(size);
+}
+
 // cppcheck-suppress unusedFunction
 void *test_calloc(size_t nelem, size_t elsize)
 {
     /* Reference: Malloc tutorial
      * https://danluu.com/malloc-tutorial/
      */
-    size_t size = nelem * elsize;  // TODO: check for overflow
+    if (elsize && nelem > SIZE_MAX / elsize) {
+        report_event(MSG_WARN, "Calloc size overflow, returning NULL");
+        return NULL;
+    }
+    size_t size = nelem * elsize;
     void *ptr = test_malloc(size);
-    memset(ptr, 0, size);
+    if (ptr)
+        memset(ptr, 0, size);
     return ptr;
 }
 
+/*
+ * A block whose new size still fits the space behind it is resized in
+ * place.  Blocks too large for the pools are handed to realloc, which may
+ * grow them in place as well.  Anything else moves to a new block.
+ */
+// cppcheck-suppress unusedFunction
+void *test_realloc(void *p, size_t size)
+{
+    if (!p)
+        return test_malloc(size);
+
+    if (!size) {
+        test_free(p);
+        return NULL;
+    }
+
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to realloc disallowed");
+        return NULL;
+    }
+
+    if (fail_allocation()) {
+        report_event(MSG_WARN, "Realloc returning NULL");
+        return NULL;
+    }
+
+    block_ele_t *b = find_header(p);
+    if (*find_footer(b) != MAGICFOOTER) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to reallocate it",
+                     p);
+        error_occurred = true;
+    }
+
+    size_t old_size = b->payload_size;
+    if (size > block_capacity(old_size)) {
+        if (old_size <= POOL_MAX_SIZE || size <= POOL_MAX_SIZE) {
+            void *new = alloc_block(size);
+            memcpy(new, p, old_size);
+            test_free(p);
+            return new;
+        }
+
+        live_remove(b);
+        block_ele_t *new_block =
+            realloc(b, size + sizeof(block_ele_t) + sizeof(size_t));
+        if (!new_block || !live_insert(new_block)) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            error_occurred = true;
+        }
+
+        // cppcheck-suppress nullPointerRedundantCheck
+        b = new_block;
+        if (b->prev)
+            b->prev->next = b;
+        else
+            allocated = b;
+        if (b->next)
+            b->next->prev = b;
+    }
+
+    if (size > old_size)
+        memset(&b->payload[old_size], FILLCHAR, size - old_size);
+    profile_free(b->site, old_size);
+    b->site = profile_alloc(site_file, site_line, size);
+    site_file = NULL;
+    b->payload_size = size;
+    *find_footer(b) = MAGICFOOTER;
+    return (void *) &b->payload;
+}
+
 void test_free(void *p)
 {
     if (noallocate_mode) {
@@ -192,6 +462,7 @@ void test_free(void *p)
                      p);
         error_occurred = true;
     }
+    profile_free(b->site, b->payload_size);
     b->magic_header = MAGICFREE;
     *find_footer(b) = MAGICFREE;
     memset(p, FILLCHAR, b->payload_size);
@@ -205,8 +476,9 @@ void test_free(void *p)
         allocated = bn;
     if (bn)
         bn->prev = bp;
+    live_remove(b);
 
-    free(b);
+    quarantine_put(b);
     allocated_count--;
 }
 
@@ -13,9 +13,12 @@
 
 void *test_malloc(size_t size);
 void *test_calloc(size_t nmemb, size_t size);
+void *test_realloc(void *p, size_t size);
 void test_free(void *p);
 char *test_strdup(const char *s);
-/* FIXME: provide test_realloc as well */
+
+/* Tell the allocation profiler where the next allocation comes from */
+void set_alloc_site(const char *file, int line);
 
 #ifdef INTERNAL
 
@@ -60,13 +63,18 @@ void trigger_exception(char *msg);
 
 #else /* !INTERNAL */
 
-/* Tested program use our versions of malloc and free */
-#define malloc test_malloc
+/*
+ * Tested program use our versions of malloc and free, which also learn
+ * the call site of every allocation
+ */
+#define malloc(size) (set_alloc_site(__FILE__, __LINE__), test_malloc(size))
+#define realloc(p, size) \
+    (set_alloc_site(__FILE__, __LINE__), test_realloc(p, size))
 #define free test_free
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
-#define strdup test_strdup
+#define strdup(s) (set_alloc_site(__FILE__, __LINE__), test_strdup(s))
 
 #endif
 
@@ -0,0 +1,127 @@
+#include "mpmc.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The ring follows Dmitry Vyukov's bounded MPMC queue.  Every slot carries
+ * a sequence number telling whose turn it is: a slot at position pos with
+ * sequence pos is free for the producer claiming pos, and one with sequence
+ * pos + 1 holds a string for the consumer claiming pos.  Producers and
+ * consumers claim positions with a compare-and-swap on their own counter,
+ * so neither side ever waits on a lock, and the slot sequence is published
+ * with release semantics once the string has been copied.
+ */
+
+#define CACHE_LINE 64
+
+typedef struct {
+    atomic_size_t seq;
+    char value[MPMC_STRING_SIZE];
+} slot_t;
+
+_Static_assert(sizeof(slot_t) == CACHE_LINE, "slot_t must fill a cache line");
+
+struct mpmc {
+    /* Keep the two counters on their own cache lines */
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    _Alignas(CACHE_LINE) size_t mask;
+    slot_t *slots;
+};
+
+mpmc_t *mpmc_new(size_t capacity)
+{
+    size_t cap = 2;
+    while (cap < capacity) {
+        if (cap > SIZE_MAX / 2 / sizeof(slot_t))
+            return NULL;
+        cap <<= 1;
+    }
+
+    mpmc_t *q = aligned_alloc(CACHE_LINE, sizeof(mpmc_t));
+    if (!q)
+        return NULL;
+    q->slots = aligned_alloc(CACHE_LINE, cap * sizeof(slot_t));
+    if (!q->slots) {
+        free(q);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < cap; i++)
+        atomic_init(&q->slots[i].seq, i);
+    q->mask = cap - 1;
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->head, 0);
+    return q;
+}
+
+void mpmc_free(mpmc_t *q)
+{
+    if (!q)
+        return;
+    free(q->slots);
+    free(q);
+}
+
+bool mpmc_insert_tail(mpmc_t *q, const char *s)
+{
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    slot_t *slot;
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            /* On failure pos is reloaded with the current tail */
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            /* The consumer of the previous lap has not freed the slot */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+
+    size_t len = strnlen(s, MPMC_STRING_SIZE - 1);
+    memcpy(slot->value, s, len);
+    slot->value[len] = '\0';
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+bool mpmc_remove_head(mpmc_t *q, char *sp, size_t bufsize)
+{
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    slot_t *slot;
+    for (;;) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            /* Nothing has been published at this position yet */
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+
+    if (sp && bufsize) {
+        size_t len = strnlen(slot->value, bufsize - 1);
+        memcpy(sp, slot->value, len);
+        sp[len] = '\0';
+    }
+    /* Hand the slot to the producer of the next lap */
+    atomic_store_explicit(&slot->seq, pos + q->mask + 1, memory_order_release);
+    return true;
+}
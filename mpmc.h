@@ -0,0 +1,46 @@
+#ifndef LAB0_MPMC_H
+#define LAB0_MPMC_H
+
+/*
+ * Bounded lock-free multi-producer, multi-consumer queue of strings.
+ *
+ * It offers the q_insert_tail/q_remove_head semantics of queue.h to any
+ * number of threads at once, at the price of a capacity fixed at creation
+ * and strings stored in fixed-size slots.  Memory comes straight from
+ * malloc, since the allocator of the harness is not thread-safe.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Longest string a slot holds, including the terminating null */
+#define MPMC_STRING_SIZE 56
+
+typedef struct mpmc mpmc_t;
+
+/*
+ * Create a queue holding at least capacity strings; capacity is rounded up
+ * to a power of two.
+ * Return NULL if could not allocate space.
+ */
+mpmc_t *mpmc_new(size_t capacity);
+
+/* Free all storage used by the queue, no other thread may still use it */
+void mpmc_free(mpmc_t *q);
+
+/*
+ * Attempt to insert a copy of string s at the tail of the queue.
+ * Strings longer than MPMC_STRING_SIZE - 1 are truncated.
+ * Return true if successful, false if the queue is full.
+ */
+bool mpmc_insert_tail(mpmc_t *q, const char *s);
+
+/*
+ * Attempt to remove the string at the head of the queue.
+ * If sp is non-NULL, copy the string to *sp, up to a maximum of
+ * bufsize - 1 characters, plus a null terminator.
+ * Return true if successful, false if the queue is empty.
+ */
+bool mpmc_remove_head(mpmc_t *q, char *sp, size_t bufsize);
+
+#endif /* LAB0_MPMC_H */
@@ -0,0 +1,104 @@
+#include "perf.h"
+
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} counters[PERF_NR_COUNTERS] = {
+    [PERF_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE,
+                           PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_L1D_MISSES] = {"l1d_misses", PERF_TYPE_HW_CACHE,
+                         PERF_COUNT_HW_CACHE_L1D |
+                             (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    [PERF_LLC_MISSES] = {"llc_misses", PERF_TYPE_HARDWARE,
+                         PERF_COUNT_HW_CACHE_MISSES},
+    [PERF_BRANCH_MISSES] = {"branch_misses", PERF_TYPE_HARDWARE,
+                            PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static int fds[PERF_NR_COUNTERS] = {-1, -1, -1, -1, -1};
+
+bool perf_open()
+{
+    perf_close();
+
+    bool any = false;
+    for (int i = 0; i < PERF_NR_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counters[i].type;
+        attr.config = counters[i].config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        any = any || fds[i] >= 0;
+    }
+    return any;
+}
+
+void perf_close()
+{
+    for (int i = 0; i < PERF_NR_COUNTERS; i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+bool perf_available()
+{
+    for (int i = 0; i < PERF_NR_COUNTERS; i++) {
+        if (fds[i] >= 0)
+            return true;
+    }
+    return false;
+}
+
+void perf_start()
+{
+    for (int i = 0; i < PERF_NR_COUNTERS; i++) {
+        if (fds[i] < 0)
+            continue;
+        ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void perf_stop(perf_sample_t *s)
+{
+    for (int i = 0; i < PERF_NR_COUNTERS; i++) {
+        if (fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    for (int i = 0; i < PERF_NR_COUNTERS; i++) {
+        /* value, time enabled, time running */
+        uint64_t buf[3];
+        s->value[i] = 0;
+        s->valid[i] = fds[i] >= 0 &&
+                      read(fds[i], buf, sizeof(buf)) == sizeof(buf) && buf[2];
+        if (!s->valid[i])
+            continue;
+        s->value[i] = buf[2] < buf[1]
+                          ? (uint64_t) ((double) buf[0] * buf[1] / buf[2])
+                          : buf[0];
+    }
+}
+
+const char *perf_name(perf_counter_t c)
+{
+    return counters[c].name;
+}
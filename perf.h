@@ -0,0 +1,52 @@
+#ifndef LAB0_PERF_H
+#define LAB0_PERF_H
+
+/*
+ * Hardware performance counters through perf_event_open(2).
+ *
+ * Every counter is opened on its own, so that the ones the CPU, the kernel
+ * or the virtual machine do not offer are simply reported as unavailable
+ * while the others keep working.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_NR_COUNTERS
+} perf_counter_t;
+
+typedef struct {
+    /* Counts, scaled up when the kernel had to multiplex the counters */
+    uint64_t value[PERF_NR_COUNTERS];
+    bool valid[PERF_NR_COUNTERS];
+} perf_sample_t;
+
+/*
+ * Open the counters for the calling process, threads it creates later
+ * included.
+ * Return false if none of them is available.
+ */
+bool perf_open();
+
+/* Close all counters */
+void perf_close();
+
+/* Return whether any counter is open */
+bool perf_available();
+
+/* Reset and start all open counters */
+void perf_start();
+
+/* Stop all open counters and read them into *s */
+void perf_stop(perf_sample_t *s);
+
+/* Short name of a counter, such as "cycles" or "llc_misses" */
+const char *perf_name(perf_counter_t c);
+
+#endif /* LAB0_PERF_H */
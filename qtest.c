@@ -1,14 +1,21 @@
 /* Implementation of testing code for queue code */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h> /* strcasecmp */
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -34,7 +41,10 @@
 #include "queue.h"
 
 #include "console.h"
+#include "mpmc.h"
+#include "random.h"
 #include "report.h"
+#include "wsdeque.h"
 
 /* Settable parameters */
 
@@ -43,11 +53,13 @@
 /*
  * How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST 30
 static int big_list_size = BIG_LIST;
 
+/* Whether show also lists the last big_list_size elements of long queues */
+static int show_tail = 0;
+
 
 /* Global variables */
 
@@ -63,12 +75,48 @@ static list_head_meta_t l_meta;
 /* Number of elements in queue */
 static size_t lcnt = 0;
 
+/*
+ * Every queue has a named slot in the chain of queues, in creation order.
+ * The one of the current queue is only brought up to date from l_meta and
+ * lcnt when it is looked at.
+ *
+ * Blocks are charged to a queue when it stops being the current one.  Queues
+ * that have been merged share a group, since their blocks can no longer be
+ * told apart, and the whole group is charged to one of them.
+ */
+typedef struct {
+    queue_contex_t ctx;
+    char *name;
+    size_t blocks;
+    int group;
+} queue_slot_t;
+
+static LIST_HEAD(queue_chain);
+static queue_slot_t *current = NULL;
+static int slot_cnt = 0;
+static int group_cnt = 0;
+
+/* Blocks already reported as leaked by queues that have been freed */
+static size_t leaked_blocks = 0;
+
 /* How many times can queue operations fail */
 static int fail_limit = BIG_LIST;
 static int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
+/* Whether new queues allocate their elements from an arena */
+static int arena_mode = 0;
+
+/* Whether new queues keep an index for positional access */
+static int index_mode = 0;
+
+/* Number of threads used by parallel sort */
+static int sort_threads = 4;
+
+/* Seed of the generator behind shuffle, RAND strings and simulation */
+static int prng_seed_value = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -76,6 +124,83 @@ static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 /* Forward declarations */
 static bool show_queue(int vlevel);
 
+/* Store the state of the current queue in its slot */
+static void save_current()
+{
+    current->ctx.q = l_meta.l;
+    current->ctx.size = lcnt;
+}
+
+/* Make the queue of the current slot the one commands work on */
+static void load_current()
+{
+    l_meta.l = current->ctx.q;
+    l_meta.size = lcnt = current->ctx.size;
+}
+
+/* Return the slot called name, adding an empty one if there is none */
+static queue_slot_t *find_slot(const char *name)
+{
+    queue_slot_t *slot;
+    list_for_each_entry (slot, &queue_chain, ctx.chain) {
+        if (!strcmp(slot->name, name))
+            return slot;
+    }
+
+    slot = malloc(sizeof(queue_slot_t));
+    char *copy = strdup(name);
+    if (!slot || !copy) {
+        free(slot);
+        free(copy);
+        return NULL;
+    }
+
+    slot->name = copy;
+    slot->ctx.q = NULL;
+    slot->ctx.size = 0;
+    slot->ctx.id = slot_cnt++;
+    slot->blocks = 0;
+    slot->group = group_cnt++;
+    list_add_tail(&slot->ctx.chain, &queue_chain);
+    return slot;
+}
+
+/* Return a live queue other than the current one in the group of the latter */
+static queue_slot_t *group_mate()
+{
+    queue_slot_t *slot;
+    list_for_each_entry (slot, &queue_chain, ctx.chain) {
+        if (slot != current && slot->ctx.q && slot->group == current->group)
+            return slot;
+    }
+    return NULL;
+}
+
+/* Return the blocks that are not charged to the group of owner */
+static size_t blocks_of_others(queue_slot_t *owner)
+{
+    size_t bcnt = leaked_blocks;
+    queue_slot_t *slot;
+    list_for_each_entry (slot, &queue_chain, ctx.chain) {
+        if (slot->ctx.q && slot->group != owner->group)
+            bcnt += slot->blocks;
+    }
+    return bcnt;
+}
+
+/* Charge every block not held by another group to owner */
+static void charge_blocks(queue_slot_t *owner)
+{
+    size_t bcnt = allocation_check();
+    size_t others = blocks_of_others(owner);
+    queue_slot_t *slot;
+    list_for_each_entry (slot, &queue_chain, ctx.chain) {
+        if (slot->group == owner->group)
+            slot->blocks = 0;
+    }
+    owner->blocks = bcnt > others ? bcnt - others : 0;
+}
+
 static bool do_free(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -88,23 +213,34 @@ static bool do_free(int argc, char *argv[])
         report(3, "Warning: Calling free on null queue");
     error_check();
 
-    if (lcnt > big_list_size)
-        set_cautious_mode(false);
     if (exception_setup(true))
         q_free(l_meta.l);
     exception_cancel();
-    set_cautious_mode(true);
 
     l_meta.size = 0;
     l_meta.l = NULL;
     lcnt = 0;
     show_queue(3);
 
-    size_t bcnt = allocation_check();
-    if (bcnt > 0) {
-        report(1, "ERROR: Freed queue, but %lu blocks are still allocated",
-               bcnt);
-        ok = false;
+    /*
+     * Blocks of the other queues are still in use.  Those of queues merged
+     * with this one cannot be told apart from its own until the last of them
+     * is freed.
+     */
+    current->blocks = 0;
+    queue_slot_t *mate = group_mate();
+    if (mate) {
+        charge_blocks(mate);
+    } else {
+        size_t bcnt = allocation_check();
+        size_t others = blocks_of_others(current);
+        if (bcnt > others) {
+            report(1,
+                   "ERROR: Freed queue %s, but %lu blocks are still allocated",
+                   current->name, bcnt - others);
+            leaked_blocks += bcnt - others;
+            ok = false;
+        }
     }
 
     return ok && !error_check();
@@ -125,11 +261,15 @@ static bool do_new(int argc, char *argv[])
     error_check();
 
     if (exception_setup(true)) {
-        l_meta.l = q_new();
+        l_meta.l = arena_mode ? q_new_arena() : q_new();
         l_meta.size = 0;
+        /* Without its index the queue still works, only slower */
+        if (l_meta.l && index_mode)
+            q_index(l_meta.l);
     }
     exception_cancel();
     lcnt = 0;
+    current->group = group_cnt++;
     show_queue(3);
 
     return ok && !error_check();
@@ -141,16 +281,98 @@ static bool do_new(int argc, char *argv[])
  */
 static void fill_rand_string(char *buf, size_t buf_size)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
+    size_t len = MIN_RANDSTR_LEN + prng_below(buf_size - MIN_RANDSTR_LEN);
 
     for (size_t n = 0; n < len; n++) {
-        buf[n] = charset[rand() % (sizeof charset - 1)];
+        buf[n] = charset[prng_below(sizeof charset - 1)];
     }
     buf[len] = '\0';
 }
 
+/* How many elements a repeated insertion hands to the queue at once */
+#define INSERT_BATCH 1024
+
+/*
+ * Insert reps elements through the batch interface, at head or at tail.
+ * Each element holds inserts, or a fresh random string when need_rand is set,
+ * and gets the same checks as on the single insertion path.
+ */
+static bool insert_batch(bool at_head, char *inserts, bool need_rand, int reps)
+{
+    char *strs[INSERT_BATCH];
+    char(*randstrs)[MAX_RANDSTR_LEN] = NULL;
+    bool ok = true;
+
+    if (need_rand) {
+        randstrs = malloc(INSERT_BATCH * sizeof(*randstrs));
+        if (!randstrs) {
+            report(1,
+                   "INTERNAL ERROR.  Could not allocate space for random "
+                   "strings");
+            return false;
+        }
+    }
+
+    if (exception_setup(true)) {
+        for (int r = 0; ok && r < reps;) {
+            int cnt = reps - r < INSERT_BATCH ? reps - r : INSERT_BATCH;
+            for (int i = 0; i < cnt; i++) {
+                if (need_rand)
+                    fill_rand_string(randstrs[i], sizeof(randstrs[i]));
+                strs[i] = need_rand ? randstrs[i] : inserts;
+            }
+
+            int done = at_head ? q_insert_head_batch(l_meta.l, strs, cnt)
+                               : q_insert_tail_batch(l_meta.l, strs, cnt);
+            lcnt += done;
+            l_meta.size += done;
+
+            /* The newest element is the one closest to the queue head */
+            struct list_head *cur = l_meta.l;
+            char *lasts = NULL;
+            for (int i = done - 1; ok && i >= 0; i--) {
+                cur = at_head ? cur->next : cur->prev;
+                char *cur_inserts = list_entry(cur, element_t, list)->value;
+                if (!cur_inserts) {
+                    report(1, "ERROR: Failed to save copy of string in queue");
+                    ok = false;
+                } else if (cur_inserts == strs[i]) {
+                    report(1,
+                           "ERROR: Need to allocate and copy string for new "
+                           "queue element");
+                    ok = false;
+                } else if (cur_inserts == lasts) {
+                    report(1,
+                           "ERROR: Need to allocate separate string for each "
+                           "queue element");
+                    ok = false;
+                }
+                lasts = cur_inserts;
+            }
+
+            r += done;
+            if (done < cnt) {
+                /* Like a failed single insertion, skip the element */
+                r++;
+                fail_count++;
+                if (fail_count < fail_limit)
+                    report(2, "Insertion of %s failed", strs[done]);
+                else {
+                    report(1,
+                           "ERROR: Insertion of %s failed (%d failures total)",
+                           strs[done], fail_count);
+                    ok = false;
+                }
+            }
+            ok = ok && !error_check();
+        }
+    }
+    exception_cancel();
+
+    free(randstrs);
+    return ok;
+}
+
 /* insert head */
 static bool do_ih(int argc, char *argv[])
 {
@@ -194,6 +416,12 @@ static bool do_ih(int argc, char *argv[])
         report(3, "Warning: Calling insert head on null queue");
     error_check();
 
+    if (reps > 1) {
+        ok = insert_batch(true, inserts, need_rand, reps);
+        show_queue(3);
+        return ok;
+    }
+
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
@@ -283,6 +511,12 @@ static bool do_it(int argc, char *argv[])
         report(3, "Warning: Calling insert tail on null queue");
     error_check();
 
+    if (reps > 1) {
+        ok = insert_batch(false, inserts, need_rand, reps);
+        show_queue(3);
+        return ok;
+    }
+
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
@@ -486,10 +720,117 @@ static bool do_rhq(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* remove many elements from head at once */
+static bool do_drain(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    int reps;
+    if (!get_int(argv[1], &reps) || reps < 0) {
+        report(1, "Invalid number of removals '%s'", argv[1]);
+        return false;
+    }
+
+    if (!l_meta.size)
+        report(3, "Warning: Calling drain on empty queue");
+    error_check();
+
+    LIST_HEAD(drained);
+    int cnt = 0;
+    bool ok = true;
+    if (exception_setup(true))
+        cnt = q_remove_head_n(l_meta.l, reps, &drained);
+    exception_cancel();
+
+    int expected = reps < lcnt ? reps : (int) lcnt;
+    struct list_head *node;
+    int len = 0;
+    list_for_each (node, &drained)
+        len++;
+    if (cnt != expected || len != expected) {
+        report(1,
+               "ERROR: Removed %d elements (%d in list), but expected %d to "
+               "be removed",
+               cnt, len, expected);
+        ok = false;
+    } else {
+        report(2, "Removed %d elements from queue", cnt);
+    }
+    lcnt -= len;
+    l_meta.size -= len;
+
+    if (exception_setup(true))
+        q_release_list(&drained);
+    exception_cancel();
+
+    show_queue(3);
+    return ok && !error_check();
+}
+
+/* String of a copied element, along with its position in the copy */
+typedef struct {
+    char *value;
+    int pos;
+} str_pos_t;
+
+static int cmp_str_pos(const void *a, const void *b)
+{
+    return strcmp(((const str_pos_t *) a)->value,
+                  ((const str_pos_t *) b)->value);
+}
+
+/*
+ * Return an array telling, for each position of list l holding n elements,
+ * whether its string occurs anywhere else in l.
+ * Return NULL if space could not be allocated.
+ */
+static bool *find_dups(struct list_head *l, int n)
+{
+    bool *dups = calloc(n + 1, sizeof(bool));
+    str_pos_t *strs = malloc((n + 1) * sizeof(str_pos_t));
+    if (!dups || !strs) {
+        free(dups);
+        free(strs);
+        return NULL;
+    }
+
+    element_t *item;
+    int i = 0;
+    list_for_each_entry (item, l, list) {
+        strs[i].value = item->value;
+        strs[i].pos = i;
+        i++;
+    }
+
+    qsort(strs, n, sizeof(str_pos_t), cmp_str_pos);
+    for (i = 0; i < n;) {
+        int j = i + 1;
+        while (j < n && !strcmp(strs[i].value, strs[j].value))
+            j++;
+        if (j - i > 1) {
+            for (int k = i; k < j; k++)
+                dups[strs[k].pos] = true;
+        }
+        i = j;
+    }
+
+    free(strs);
+    return dups;
+}
+
 static bool do_dedup(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    bool hash = argc == 2;
+    if (hash && strcmp(argv[1], "hash")) {
+        report(1, "Unknown dedup mode '%s'", argv[1]);
         return false;
     }
 
@@ -526,9 +867,25 @@ static bool do_dedup(int argc, char *argv[])
         }
     }
 
+    /* Unsorted input may hold duplicates anywhere, find them up front */
+    bool *dups = NULL;
+    if (hash && l_meta.l) {
+        dups = find_dups(&l_copy, lcnt);
+        if (!dups) {
+            list_for_each_entry_safe (item, tmp, &l_copy, list) {
+                free(item->value);
+                free(item);
+            }
+            report(1,
+                   "INTERNAL ERROR.  Could not allocate space for "
+                   "duplicate checking");
+            return false;
+        }
+    }
+
     bool ok = true;
     if (exception_setup(true))
-        ok = q_delete_dup(l_meta.l);
+        ok = hash ? q_delete_dup_unsorted(l_meta.l) : q_delete_dup(l_meta.l);
     exception_cancel();
 
     if (!ok) {
@@ -536,12 +893,29 @@ static bool do_dedup(int argc, char *argv[])
             free(item->value);
             free(item);
         }
-        report(1, "ERROR: Calling delete duplicate on null queue");
-        return false;
+        free(dups);
+        if (!l_meta.l) {
+            report(1, "ERROR: Calling delete duplicate on null queue");
+            return false;
+        }
+
+        /* The queue is left untouched, like after a failed insertion */
+        fail_count++;
+        if (fail_count < fail_limit) {
+            report(2, "Could not allocate hash table");
+        } else {
+            report(1,
+                   "ERROR: Could not allocate hash table (%d failures total)",
+                   fail_count);
+            return false;
+        }
+        show_queue(3);
+        return !error_check();
     }
 
     struct list_head *l_tmp = l_meta.l->next;
     bool is_this_dup = false;
+    int pos = 0;
     // Compare between new list and old one
     list_for_each_entry (item, &l_copy, list) {
         // Skip comparison with new list if the string is duplicate
@@ -549,7 +923,8 @@ static bool do_dedup(int argc, char *argv[])
             item->list.next != &l_copy &&
             strcmp(list_entry(item->list.next, element_t, list)->value,
                    item->value) == 0;
-        if (is_this_dup || is_next_dup) {
+        bool is_dup = dups ? dups[pos++] : is_this_dup || is_next_dup;
+        if (is_dup) {
             // Update list size
             lcnt--;
             l_meta.size--;
@@ -572,6 +947,7 @@ static bool do_dedup(int argc, char *argv[])
         free(item->value);
         free(item);
     }
+    free(dups);
 
     show_queue(3);
     return ok && !error_check();
@@ -647,13 +1023,37 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Names accepted by the sort command to pick an algorithm */
+static const struct {
+    char *name;
+    sort_engine_t engine;
+} sort_engines[] = {
+    {"merge", SORT_MERGE},
+    {"prefix", SORT_PREFIX},
+    {"radix", SORT_RADIX},
+    {"parallel", SORT_PARALLEL},
+};
+
 bool do_sort(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
     }
 
+    sort_engine_t engine = SORT_MERGE;
+    if (argc == 2) {
+        int i = 0;
+        int n = sizeof(sort_engines) / sizeof(sort_engines[0]);
+        while (i < n && strcmp(argv[1], sort_engines[i].name))
+            i++;
+        if (i == n) {
+            report(1, "Unknown sort engine '%s'", argv[1]);
+            return false;
+        }
+        engine = sort_engines[i].engine;
+    }
+
     if (!l_meta.l)
         report(3, "Warning: Calling sort on null queue");
     error_check();
@@ -663,6 +1063,8 @@ bool do_sort(int argc, char *argv[])
         report(3, "Warning: Calling sort on single node");
     error_check();
 
+    q_sort_engine(engine);
+    q_sort_threads(sort_threads);
     set_noallocate_mode(true);
     if (exception_setup(true))
         q_sort(l_meta.l);
@@ -690,28 +1092,97 @@ bool do_sort(int argc, char *argv[])
     return ok && !error_check();
 }
 
-static bool do_dm(int argc, char *argv[])
+static bool do_use(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs a queue name", argv[0]);
+        return false;
+    }
+
+    queue_slot_t *slot = find_slot(argv[1]);
+    if (!slot) {
+        report(1, "INTERNAL ERROR.  Could not allocate queue slot");
+        return false;
+    }
+    if (l_meta.l)
+        charge_blocks(current);
+    save_current();
+    current = slot;
+    load_current();
+    show_queue(3);
+    return true;
+}
+
+static bool do_queues(int argc, char *argv[])
 {
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
     }
 
-    if (!l_meta.l)
-        report(3, "Warning: Try to access null queue");
+    save_current();
+    queue_slot_t *slot;
+    list_for_each_entry (slot, &queue_chain, ctx.chain) {
+        if (slot->ctx.q)
+            report(1, "%c %s: %d elements", slot == current ? '*' : ' ',
+                   slot->name, slot->ctx.size);
+        else
+            report(1, "%c %s: NULL", slot == current ? '*' : ' ', slot->name);
+    }
+    return true;
+}
+
+static bool do_merge(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+    if (!l_meta.l) {
+        report(1, "ERROR: Calling merge on null queue");
+        return false;
+    }
     error_check();
 
-    bool ok = true;
+    /*
+     * The current queue goes first so that everything ends up in it, then
+     * back to its place in the chain
+     */
+    save_current();
+    struct list_head *prev = current->ctx.chain.prev;
+    list_move(&current->ctx.chain, &queue_chain);
+    int len = 0;
+    set_noallocate_mode(true);
     if (exception_setup(true))
-        ok = q_delete_mid(l_meta.l);
+        len = q_merge(&queue_chain);
     exception_cancel();
+    set_noallocate_mode(false);
+    list_move(&current->ctx.chain, prev);
+
+    queue_slot_t *slot;
+    list_for_each_entry (slot, &queue_chain, ctx.chain) {
+        slot->ctx.size = slot == current ? len : 0;
+        if (slot->ctx.q)
+            slot->group = current->group;
+    }
+    load_current();
+
+    bool ok = true;
+    struct list_head *cur = l_meta.l->next;
+    for (int i = 1; i < len && ok; i++, cur = cur->next) {
+        element_t *item = list_entry(cur, element_t, list);
+        element_t *next_item = list_entry(cur->next, element_t, list);
+        if (strcmp(item->value, next_item->value) > 0) {
+            report(1, "ERROR: Not sorted in ascending order");
+            ok = false;
+        }
+    }
 
-    lcnt--;
     show_queue(3);
     return ok && !error_check();
 }
 
-static bool do_swap(int argc, char *argv[])
+static bool do_dm(int argc, char *argv[])
 {
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
@@ -722,43 +1193,157 @@ static bool do_swap(int argc, char *argv[])
         report(3, "Warning: Try to access null queue");
     error_check();
 
-    set_noallocate_mode(true);
+    bool ok = true;
     if (exception_setup(true))
-        q_swap(l_meta.l);
+        ok = q_delete_mid(l_meta.l);
     exception_cancel();
 
-    set_noallocate_mode(false);
-
+    if (ok)
+        lcnt--;
     show_queue(3);
-    return !error_check();
+    return ok && !error_check();
 }
 
-static bool is_circular()
+/* Read the position argument of at and da into *i */
+static bool get_position(int argc, char *argv[], int *i)
 {
-    struct list_head *cur = l_meta.l->next;
-    while (cur != l_meta.l) {
-        if (!cur)
-            return false;
-        cur = cur->next;
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
     }
-
-    cur = l_meta.l->prev;
-    while (cur != l_meta.l) {
-        if (!cur)
-            return false;
-        cur = cur->prev;
+    if (!get_int(argv[1], i) || *i < 0) {
+        report(1, "Invalid position '%s'", argv[1]);
+        return false;
     }
+
+    if (!l_meta.l)
+        report(3, "Warning: Try to access null queue");
+    error_check();
     return true;
 }
 
-static bool show_queue(int vlevel)
+static bool do_at(int argc, char *argv[])
 {
-    bool ok = true;
-    if (verblevel < vlevel)
-        return true;
+    int i;
+    if (!get_position(argc, argv, &i))
+        return false;
 
-    int cnt = 0;
-    if (!l_meta.l) {
+    element_t *e = NULL;
+    if (exception_setup(true))
+        e = q_at(l_meta.l, i);
+    exception_cancel();
+
+    bool ok = true;
+    if (i >= (int) lcnt) {
+        if (e) {
+            report(1, "ERROR: Found element at position %d of %d", i,
+                   (int) lcnt);
+            ok = false;
+        } else {
+            report(1, "No element at position %d", i);
+        }
+    } else if (!e) {
+        report(1, "ERROR: Failed to find element at position %d", i);
+        ok = false;
+    } else {
+        report(1, "l[%d] = %s", i, e->value);
+    }
+    return ok && !error_check();
+}
+
+static bool do_da(int argc, char *argv[])
+{
+    int i;
+    if (!get_position(argc, argv, &i))
+        return false;
+
+    bool ok = true;
+    if (exception_setup(true))
+        ok = q_delete_at(l_meta.l, i);
+    exception_cancel();
+
+    if (ok != (i < (int) lcnt)) {
+        report(1, "ERROR: Deleting at position %d of %d returned %s", i,
+               (int) lcnt, ok ? "true" : "false");
+        ok = false;
+    } else if (ok) {
+        lcnt--;
+    }
+    show_queue(3);
+    return ok && !error_check();
+}
+
+static bool do_swap(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!l_meta.l)
+        report(3, "Warning: Try to access null queue");
+    error_check();
+
+    set_noallocate_mode(true);
+    if (exception_setup(true))
+        q_swap(l_meta.l);
+    exception_cancel();
+
+    set_noallocate_mode(false);
+
+    show_queue(3);
+    return !error_check();
+}
+
+static bool is_circular()
+{
+    struct list_head *cur = l_meta.l->next;
+    while (cur != l_meta.l) {
+        if (!cur)
+            return false;
+        cur = cur->next;
+    }
+
+    cur = l_meta.l->prev;
+    while (cur != l_meta.l) {
+        if (!cur)
+            return false;
+        cur = cur->prev;
+    }
+    return true;
+}
+
+/* Line show_queue renders a queue into, to report it in a single write */
+static char *show_buf = NULL;
+static size_t show_cap = 0;
+static size_t show_len = 0;
+
+/* Append s to show_buf, leaving the line cut short if space runs out */
+static void show_append(const char *s)
+{
+    size_t len = strlen(s);
+    if (show_len + len + 1 > show_cap) {
+        size_t cap = show_cap ? show_cap : 4096;
+        while (show_len + len + 1 > cap)
+            cap *= 2;
+        char *buf = realloc(show_buf, cap);
+        if (!buf)
+            return;
+        show_buf = buf;
+        show_cap = cap;
+    }
+    memcpy(show_buf + show_len, s, len + 1);
+    show_len += len;
+}
+
+static bool show_queue(int vlevel)
+{
+    bool ok = true;
+    if (verblevel < vlevel)
+        return true;
+
+    int cnt = 0;
+    if (!l_meta.l) {
         report(vlevel, "l = NULL");
         return true;
     }
@@ -768,7 +1353,8 @@ static bool show_queue(int vlevel)
         return false;
     }
 
-    report_noreturn(vlevel, "l = [");
+    show_len = 0;
+    show_append("l = [");
 
     struct list_head *ori = l_meta.l;
     struct list_head *cur = l_meta.l->next;
@@ -776,27 +1362,47 @@ static bool show_queue(int vlevel)
     if (exception_setup(true)) {
         while (ok && ori != cur && cnt < lcnt) {
             element_t *e = list_entry(cur, element_t, list);
-            if (cnt < big_list_size)
-                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
+            if (cnt < big_list_size) {
+                if (cnt)
+                    show_append(" ");
+                show_append(e->value);
+            }
             cnt++;
             cur = cur->next;
             ok = ok && !error_check();
         }
+
+        /* Walked back from the tail, past the elements already shown */
+        if (ok && cur == ori && show_tail && cnt > big_list_size) {
+            int last = cnt - big_list_size;
+            if (last > big_list_size) {
+                last = big_list_size;
+                show_append(" ...");
+            }
+            struct list_head *node = ori;
+            for (int i = 0; i < last; i++)
+                node = node->prev;
+            for (; node != ori; node = node->next) {
+                show_append(" ");
+                show_append(list_entry(node, element_t, list)->value);
+            }
+        }
     }
     exception_cancel();
 
+    const char *line = show_len ? show_buf : "";
     if (!ok) {
-        report(vlevel, " ... ]");
+        report(vlevel, "%s ... ]", line);
         return false;
     }
 
     if (cur == ori) {
-        if (cnt <= big_list_size)
-            report(vlevel, "]");
+        if (cnt <= big_list_size || show_tail)
+            report(vlevel, "%s]", line);
         else
-            report(vlevel, " ... ]");
+            report(vlevel, "%s ... ]", line);
     } else {
-        report(vlevel, " ... ]");
+        report(vlevel, "%s ... ]", line);
         report(vlevel, "ERROR:  Queue has more than %d elements", lcnt);
         ok = false;
     }
@@ -813,18 +1419,420 @@ static bool do_show(int argc, char *argv[])
     return show_queue(0);
 }
 
-void q_shuffle(struct list_head *head)
+/* munmap, in the shape q_arena_adopt expects */
+static void unmap(void *mem, size_t size)
 {
-    if (!head)
-        return;
+    munmap(mem, size);
+}
+
+/*
+ * Map the whole of file name privately with protection prot, storing its
+ * size in *len.  Return NULL for an empty file, MAP_FAILED on failure.
+ */
+static char *map_file(const char *name, int prot, size_t *len)
+{
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        report(1, "Could not open file '%s'", name);
+        if (fd >= 0)
+            close(fd);
+        return MAP_FAILED;
+    }
+
+    *len = st.st_size;
+    char *map = NULL;
+    if (*len)
+        map = mmap(NULL, *len, prot, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        report(1, "Could not map file '%s'", name);
+    return map;
+}
 
-    for (int i = q_size(head); i > 0; i--) {
-        struct list_head *node = head->next;
-        for (int j = rand() % i; j > 0; j--) {
-            node = node->next;
+/*
+ * Insert every non-empty line of a file in one pass.  The file is mapped
+ * privately and its line ends overwritten with terminators in place.  An
+ * arena-backed queue then points its elements straight into the mapping,
+ * which it releases when freed, while other queues copy the lines in bulk.
+ */
+static bool do_load(int argc, char *argv[])
+{
+    bool at_head = argc == 3 && !strcmp(argv[2], "head");
+    if (argc < 2 || argc > 3 ||
+        (argc == 3 && !at_head && strcmp(argv[2], "tail"))) {
+        report(1, "%s needs a file name, then head or tail (default: tail)",
+               argv[0]);
+        return false;
+    }
+    if (!l_meta.l) {
+        report(1, "ERROR: Calling load on null queue");
+        return false;
+    }
+
+    size_t len;
+    char *map = map_file(argv[1], PROT_READ | PROT_WRITE, &len);
+    if (map == MAP_FAILED)
+        return false;
+
+    char *end = map + len;
+    size_t n = 0;
+    for (char *p = map; p < end; n++) {
+        char *eol = memchr(p, '\n', end - p);
+        p = eol ? eol + 1 : end;
+    }
+    if (n > INT_MAX) {
+        report(1, "File '%s' has more than %d lines", argv[1], INT_MAX);
+        munmap(map, len);
+        return false;
+    }
+
+    /*
+     * A last line without a newline has nowhere to put its terminator, it is
+     * copied out and inserted on its own after the others.
+     */
+    char **lines = malloc((n ? n : 1) * sizeof(char *));
+    char *last = NULL;
+    if (!lines) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for lines");
+        if (len)
+            munmap(map, len);
+        return false;
+    }
+    int cnt = 0;
+    for (char *p = map; p < end;) {
+        char *eol = memchr(p, '\n', end - p);
+        if (!eol) {
+            size_t tail = end - p;
+            if (p[tail - 1] == '\r')
+                tail--;
+            if (tail) {
+                last = strndup(p, tail);
+                if (!last)
+                    report(1, "INTERNAL ERROR.  Could not copy last line");
+            }
+            break;
+        }
+        *eol = '\0';
+        if (eol > p && eol[-1] == '\r')
+            eol[-1] = '\0';
+        /* Empty strings cannot be told apart from failed removals */
+        if (*p)
+            lines[cnt++] = p;
+        p = eol + 1;
+    }
+
+    error_check();
+    bool ok = true;
+    bool borrow = len && q_arena_adopt(l_meta.l, map, len, unmap);
+    if (exception_setup(true)) {
+        int done;
+        if (borrow)
+            done = at_head ? q_insert_head_ref(l_meta.l, lines, cnt)
+                           : q_insert_tail_ref(l_meta.l, lines, cnt);
+        else
+            done = at_head ? q_insert_head_batch(l_meta.l, lines, cnt)
+                           : q_insert_tail_batch(l_meta.l, lines, cnt);
+        if (done == cnt && last) {
+            done += at_head ? q_insert_head(l_meta.l, last)
+                            : q_insert_tail(l_meta.l, last);
+            cnt++;
+        }
+        lcnt += done;
+        l_meta.size += done;
+        if (done < cnt) {
+            report(1, "ERROR: Inserted %d of the %d lines of '%s'", done,
+                   cnt, argv[1]);
+            ok = false;
+        }
+    }
+    exception_cancel();
+
+    free(last);
+    free(lines);
+    if (len && !borrow)
+        munmap(map, len);
+    show_queue(3);
+    return ok && !error_check();
+}
+
+/* Pieces of output gathered by dump before each writev */
+#define DUMP_IOV 1024
+
+/* Write out iov[0] to iov[cnt - 1] in full, resuming after short writes */
+static bool writev_all(int fd, struct iovec *iov, int cnt)
+{
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        for (; cnt > 0 && (size_t) n >= iov->iov_len; iov++, cnt--)
+            n -= iov->iov_len;
+        if (cnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
         }
-        list_move_tail(node, head);
     }
+    return true;
+}
+
+/* Write the strings of the queue to a file, one per line */
+static bool do_dump(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs a file name", argv[0]);
+        return false;
+    }
+    if (!l_meta.l) {
+        report(1, "ERROR: Calling dump on null queue");
+        return false;
+    }
+
+    int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        report(1, "Could not open file '%s'", argv[1]);
+        return false;
+    }
+
+    static char newline[] = "\n";
+    struct iovec iov[DUMP_IOV];
+    int cnt = 0;
+    bool ok = true;
+    error_check();
+    if (exception_setup(true)) {
+        element_t *e;
+        list_for_each_entry (e, l_meta.l, list) {
+            iov[cnt++] = (struct iovec){e->value, strlen(e->value)};
+            iov[cnt++] = (struct iovec){newline, 1};
+            if (cnt == DUMP_IOV) {
+                ok = writev_all(fd, iov, cnt);
+                cnt = 0;
+                if (!ok)
+                    break;
+            }
+        }
+        ok = ok && writev_all(fd, iov, cnt);
+    }
+    exception_cancel();
+
+    if (close(fd) < 0)
+        ok = false;
+    if (!ok)
+        report(1, "ERROR: Could not write to file '%s'", argv[1]);
+    return ok && !error_check();
+}
+
+/*
+ * Snapshot of a queue, as written by save: this header, then its strings in
+ * list order, each as a 32-bit length, terminator included, followed by its
+ * bytes.  Integers are in host byte order.
+ */
+#define SNAPSHOT_MAGIC "QSNP"
+#define SNAPSHOT_VERSION 1
+/* The strings are in ascending order */
+#define SNAPSHOT_SORTED 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t count;
+    /* Size of the string table following the header */
+    uint64_t bytes;
+} snapshot_header_t;
+
+static bool do_save(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs a file name", argv[0]);
+        return false;
+    }
+    if (!l_meta.l) {
+        report(1, "ERROR: Calling save on null queue");
+        return false;
+    }
+
+    int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        report(1, "Could not open file '%s'", argv[1]);
+        return false;
+    }
+
+    snapshot_header_t hdr = {.version = SNAPSHOT_VERSION,
+                             .flags = SNAPSHOT_SORTED};
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    uint32_t lens[DUMP_IOV / 2];
+    struct iovec iov[DUMP_IOV];
+    int cnt = 0;
+    bool ok = true;
+    error_check();
+    if (exception_setup(true)) {
+        /* Size up the table and see whether it is sorted first */
+        element_t *e;
+        const char *prev = NULL;
+        list_for_each_entry (e, l_meta.l, list) {
+            hdr.count++;
+            hdr.bytes += sizeof(uint32_t) + strlen(e->value) + 1;
+            if (prev && strcmp(prev, e->value) > 0)
+                hdr.flags &= ~SNAPSHOT_SORTED;
+            prev = e->value;
+        }
+
+        ok = writev_all(fd, &(struct iovec){&hdr, sizeof(hdr)}, 1);
+        list_for_each_entry (e, l_meta.l, list) {
+            if (!ok)
+                break;
+            uint32_t *slen = &lens[cnt / 2];
+            *slen = strlen(e->value) + 1;
+            iov[cnt] = (struct iovec){slen, sizeof(*slen)};
+            iov[cnt + 1] = (struct iovec){e->value, *slen};
+            cnt += 2;
+            if (cnt == DUMP_IOV) {
+                ok = writev_all(fd, iov, cnt);
+                cnt = 0;
+            }
+        }
+        ok = ok && writev_all(fd, iov, cnt);
+    }
+    exception_cancel();
+
+    if (close(fd) < 0)
+        ok = false;
+    if (!ok)
+        report(1, "ERROR: Could not write to file '%s'", argv[1]);
+    return ok && !error_check();
+}
+
+/*
+ * Append the strings of a snapshot to the queue.  The file is mapped, and
+ * arena-backed queues point their elements straight at the strings in the
+ * mapping, their nodes all carved from a single slab.  A snapshot of a
+ * sorted queue restored into an empty one lets q_sort skip its work.
+ */
+static bool do_restore(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs a file name", argv[0]);
+        return false;
+    }
+    if (!l_meta.l) {
+        report(1, "ERROR: Calling restore on null queue");
+        return false;
+    }
+
+    size_t len;
+    char *map = map_file(argv[1], PROT_READ, &len);
+    if (map == MAP_FAILED)
+        return false;
+
+    /* Each string takes at least its length and a terminator */
+    snapshot_header_t hdr;
+    if (len >= sizeof(hdr))
+        memcpy(&hdr, map, sizeof(hdr));
+    if (len < sizeof(hdr) ||
+        memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic)) ||
+        hdr.version != SNAPSHOT_VERSION || hdr.bytes != len - sizeof(hdr) ||
+        hdr.count > INT_MAX ||
+        hdr.count > hdr.bytes / (sizeof(uint32_t) + 1)) {
+        report(1, "ERROR: '%s' is not a queue snapshot", argv[1]);
+        if (len)
+            munmap(map, len);
+        return false;
+    }
+
+    char **strs = malloc((hdr.count ? hdr.count : 1) * sizeof(char *));
+    if (!strs) {
+        report(1, "INTERNAL ERROR.  Could not allocate space for strings");
+        munmap(map, len);
+        return false;
+    }
+
+    /* Every string has to fit in the table and carry its terminator */
+    char *p = map + sizeof(hdr), *end = map + len;
+    int cnt = 0;
+    while (cnt < (int) hdr.count && end - p >= (ptrdiff_t) sizeof(uint32_t)) {
+        uint32_t slen;
+        memcpy(&slen, p, sizeof(slen));
+        p += sizeof(slen);
+        if (!slen || slen > (size_t) (end - p) || p[slen - 1])
+            break;
+        strs[cnt++] = p;
+        p += slen;
+    }
+    if (cnt < (int) hdr.count || p != end) {
+        report(1, "ERROR: Snapshot '%s' is corrupted", argv[1]);
+        free(strs);
+        munmap(map, len);
+        return false;
+    }
+
+    error_check();
+    bool ok = true;
+    bool was_empty = !lcnt;
+    bool borrow = q_arena_adopt(l_meta.l, map, len, unmap);
+    if (exception_setup(true)) {
+        int done = borrow ? q_insert_tail_ref(l_meta.l, strs, cnt)
+                          : q_insert_tail_batch(l_meta.l, strs, cnt);
+        lcnt += done;
+        l_meta.size += done;
+        if (done < cnt) {
+            report(1, "ERROR: Restored %d of the %d strings of '%s'", done,
+                   cnt, argv[1]);
+            ok = false;
+        } else if (was_empty && (hdr.flags & SNAPSHOT_SORTED)) {
+            q_hint_sorted(l_meta.l);
+        }
+    }
+    exception_cancel();
+
+    free(strs);
+    if (!borrow)
+        munmap(map, len);
+    show_queue(3);
+    return ok && !error_check();
+}
+
+/*
+ * Fisher-Yates shuffle.  The nodes are gathered into an array first so that
+ * each step picks its node in constant time, then relinked in the new order.
+ * Return false if the array could not be allocated.
+ */
+bool q_shuffle(struct list_head *head)
+{
+    if (!head)
+        return true;
+
+    int n = q_size(head);
+    if (n < 2)
+        return true;
+
+    struct list_head **nodes = malloc(n * sizeof(struct list_head *));
+    if (!nodes)
+        return false;
+
+    struct list_head *node;
+    int i = 0;
+    list_for_each (node, head)
+        nodes[i++] = node;
+
+    for (i = n - 1; i > 0; i--) {
+        int j = prng_below(i + 1);
+        node = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = node;
+    }
+
+    INIT_LIST_HEAD(head);
+    for (i = 0; i < n; i++)
+        list_add_tail(nodes[i], head);
+    q_relinked(head);
+
+    free(nodes);
+    return true;
 }
 
 static bool do_shuffle(int argc, char *argv[])
@@ -838,14 +1846,399 @@ static bool do_shuffle(int argc, char *argv[])
         report(3, "Warning: Calling shuffle on null queue");
     error_check();
 
+    bool ok = true;
     set_noallocate_mode(true);
     if (exception_setup(true))
-        q_shuffle(l_meta.l);
+        ok = q_shuffle(l_meta.l);
     exception_cancel();
 
     set_noallocate_mode(false);
+    if (!ok)
+        report(1, "INTERNAL ERROR.  Could not allocate space for shuffling");
     show_queue(3);
-    return !error_check();
+    return ok && !error_check();
+}
+
+/* Default number of strings passed through the queue by mpmc */
+#define MPMC_OPS 1000000
+
+/* Capacity of the queue used by mpmc */
+#define MPMC_CAPACITY 1024
+
+typedef struct {
+    pthread_t thread;
+    mpmc_t *q;
+    int id;
+    /* Producers: number of strings to insert */
+    long ops;
+    /* Consumers: strings still to be removed, shared by all consumers */
+    atomic_long *remaining;
+    /* Consumers: last sequence number seen from each producer */
+    long *last;
+    int nproducers;
+    /* Set when a thread could not be started, so nobody waits forever */
+    atomic_bool *aborted;
+    bool ok;
+    bool started;
+} mpmc_worker_t;
+
+static void *mpmc_producer(void *arg)
+{
+    mpmc_worker_t *w = arg;
+    char buf[MPMC_STRING_SIZE];
+    for (long i = 0; i < w->ops; i++) {
+        snprintf(buf, sizeof(buf), "%d:%ld", w->id, i);
+        while (!mpmc_insert_tail(w->q, buf)) {
+            if (atomic_load(w->aborted))
+                return NULL;
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Remove strings until all producers are done.  Since each producer inserts
+ * its strings in order, every consumer must see increasing sequence numbers
+ * from any one producer.
+ */
+static void *mpmc_consumer(void *arg)
+{
+    mpmc_worker_t *w = arg;
+    char buf[MPMC_STRING_SIZE];
+    while (atomic_fetch_sub(w->remaining, 1) > 0) {
+        while (!mpmc_remove_head(w->q, buf, sizeof(buf))) {
+            if (atomic_load(w->aborted))
+                return NULL;
+            sched_yield();
+        }
+
+        char *end;
+        long id = strtol(buf, &end, 10);
+        long seq = *end == ':' ? strtol(end + 1, NULL, 10) : -1;
+        if (id < 0 || id >= w->nproducers || seq <= w->last[id]) {
+            w->ok = false;
+            continue;
+        }
+        w->last[id] = seq;
+    }
+    return NULL;
+}
+
+static bool do_mpmc(int argc, char *argv[])
+{
+    if (argc != 3 && argc != 4) {
+        report(1, "%s needs 2-3 arguments", argv[0]);
+        return false;
+    }
+
+    int np, nc, ops = MPMC_OPS;
+    if (!get_int(argv[1], &np) || np < 1) {
+        report(1, "Invalid number of producers '%s'", argv[1]);
+        return false;
+    }
+    if (!get_int(argv[2], &nc) || nc < 1) {
+        report(1, "Invalid number of consumers '%s'", argv[2]);
+        return false;
+    }
+    if (argc == 4 && (!get_int(argv[3], &ops) || ops < 1)) {
+        report(1, "Invalid number of operations '%s'", argv[3]);
+        return false;
+    }
+
+    mpmc_t *q = mpmc_new(MPMC_CAPACITY);
+    mpmc_worker_t *workers = calloc(np + nc, sizeof(mpmc_worker_t));
+    long *last = malloc(sizeof(long) * nc * np);
+    if (!q || !workers || !last) {
+        mpmc_free(q);
+        free(workers);
+        free(last);
+        report(1, "INTERNAL ERROR.  Could not allocate space for mpmc");
+        return false;
+    }
+
+    atomic_long remaining = ops;
+    atomic_bool aborted = false;
+    for (int i = 0; i < np + nc; i++) {
+        mpmc_worker_t *w = &workers[i];
+        w->q = q;
+        w->ok = true;
+        w->aborted = &aborted;
+        if (i < np) {
+            w->id = i;
+            w->ops = ops / np + (i < ops % np);
+        } else {
+            w->remaining = &remaining;
+            w->last = &last[(i - np) * np];
+            w->nproducers = np;
+            for (int j = 0; j < np; j++)
+                w->last[j] = -1;
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Workers block all signals, leaving them to the main thread */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 0; i < np + nc && !aborted; i++) {
+        mpmc_worker_t *w = &workers[i];
+        w->started = !pthread_create(&w->thread, NULL,
+                                     i < np ? mpmc_producer : mpmc_consumer, w);
+        if (!w->started)
+            atomic_store(&aborted, true);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    bool ok = !aborted;
+    for (int i = 0; i < np + nc; i++) {
+        if (workers[i].started)
+            pthread_join(workers[i].thread, NULL);
+        ok = ok && workers[i].ok;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (aborted) {
+        report(1, "ERROR: Could not start %d threads", np + nc);
+    } else if (!ok || mpmc_remove_head(q, NULL, 0)) {
+        report(1, "ERROR: Strings were lost, duplicated or reordered");
+        ok = false;
+    } else {
+        double elapsed = (double) (end.tv_sec - start.tv_sec) +
+                         (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+        report(1,
+               "%d producers, %d consumers: %d strings in %.3f seconds "
+               "(%.0f ops/sec)",
+               np, nc, ops, elapsed, elapsed > 0 ? 2.0 * ops / elapsed : 0.0);
+    }
+
+    mpmc_free(q);
+    free(workers);
+    free(last);
+    return ok;
+}
+
+/* Default number of tasks run by steal */
+#define STEAL_TASKS 1000000
+
+/* Number of loop iterations making up one task */
+#define STEAL_TASK_WORK 64
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    int nthreads;
+    wsdeque_t **deques;
+    /* Tasks not run yet, shared by all workers */
+    atomic_long *remaining;
+    /* How many times each task has been run */
+    atomic_uchar *runs;
+    long stolen;
+    bool started;
+} steal_worker_t;
+
+/* The task is its index plus one, so that it is never NULL */
+static void run_task(steal_worker_t *w, void *task)
+{
+    volatile unsigned sink = 0;
+    for (int i = 0; i < STEAL_TASK_WORK; i++)
+        sink += i;
+    atomic_fetch_add_explicit(&w->runs[(uintptr_t) task - 1], 1,
+                              memory_order_relaxed);
+    atomic_fetch_sub_explicit(w->remaining, 1, memory_order_relaxed);
+}
+
+/*
+ * Run tasks from the own deque, and once it runs dry steal from randomly
+ * chosen victims until every task has been run.
+ */
+static void *steal_worker(void *arg)
+{
+    steal_worker_t *w = arg;
+    wsdeque_t *own = w->deques[w->id];
+    /* xorshift64, the shared generator is not thread-safe */
+    uint64_t x = 0x9e3779b97f4a7c15ULL * (w->id + 1);
+    for (;;) {
+        void *task = wsdeque_pop(own);
+        if (!task && w->nthreads > 1) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            int victim = (int) (x % (w->nthreads - 1));
+            if (victim >= w->id)
+                victim++;
+            task = wsdeque_steal(w->deques[victim]);
+            if (task)
+                w->stolen++;
+        }
+        if (task) {
+            run_task(w, task);
+            continue;
+        }
+        if (!atomic_load_explicit(w->remaining, memory_order_relaxed))
+            break;
+        sched_yield();
+    }
+    return NULL;
+}
+
+static bool do_steal(int argc, char *argv[])
+{
+    if (argc != 3 && argc != 4) {
+        report(1, "%s needs 2-3 arguments", argv[0]);
+        return false;
+    }
+
+    bool heavy = !strcmp(argv[1], "heavy");
+    if (!heavy && strcmp(argv[1], "light")) {
+        report(1, "Unknown steal scenario '%s'", argv[1]);
+        return false;
+    }
+    int k, n = STEAL_TASKS;
+    if (!get_int(argv[2], &k) || k < 1) {
+        report(1, "Invalid number of threads '%s'", argv[2]);
+        return false;
+    }
+    if (argc == 4 && (!get_int(argv[3], &n) || n < 1)) {
+        report(1, "Invalid number of tasks '%s'", argv[3]);
+        return false;
+    }
+
+    steal_worker_t *workers = calloc(k, sizeof(steal_worker_t));
+    wsdeque_t **deques = calloc(k, sizeof(wsdeque_t *));
+    atomic_uchar *runs = calloc(n, sizeof(atomic_uchar));
+    bool ok = workers && deques && runs;
+
+    /*
+     * Light: the tasks are dealt out evenly, so workers only steal near the
+     * end.  Heavy: the first worker gets them all and the others live off
+     * stealing.
+     */
+    for (int i = 0; ok && i < k; i++) {
+        int share = heavy ? (i ? 0 : n) : n / k + (i < n % k);
+        deques[i] = wsdeque_new(share);
+        ok = deques[i];
+    }
+    if (!ok) {
+        for (int i = 0; deques && i < k; i++)
+            wsdeque_free(deques[i]);
+        free(workers);
+        free(deques);
+        free(runs);
+        report(1, "INTERNAL ERROR.  Could not allocate space for steal");
+        return false;
+    }
+    for (int i = 0; i < n; i++)
+        wsdeque_push(deques[heavy ? 0 : i % k], (void *) (uintptr_t) (i + 1));
+
+    atomic_long remaining = n;
+    for (int i = 0; i < k; i++) {
+        workers[i].id = i;
+        workers[i].nthreads = k;
+        workers[i].deques = deques;
+        workers[i].remaining = &remaining;
+        workers[i].runs = runs;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Workers block all signals, leaving them to the main thread */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int i = 1; i < k; i++)
+        workers[i].started = !pthread_create(&workers[i].thread, NULL,
+                                             steal_worker, &workers[i]);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    /*
+     * The calling thread is the first worker; the tasks of any worker that
+     * could not be started are stolen by the others.
+     */
+    steal_worker(&workers[0]);
+    long stolen = workers[0].stolen;
+    for (int i = 1; i < k; i++) {
+        if (workers[i].started)
+            pthread_join(workers[i].thread, NULL);
+        stolen += workers[i].stolen;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (int i = 0; ok && i < n; i++)
+        ok = atomic_load(&runs[i]) == 1;
+    if (!ok) {
+        report(1, "ERROR: Tasks were lost or run more than once");
+    } else {
+        double elapsed = (double) (end.tv_sec - start.tv_sec) +
+                         (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+        report(1,
+               "%s, %d threads: %d tasks in %.3f seconds (%.0f tasks/sec, "
+               "%ld stolen)",
+               argv[1], k, n, elapsed, elapsed > 0 ? n / elapsed : 0.0,
+               stolen);
+    }
+
+    for (int i = 0; i < k; i++)
+        wsdeque_free(deques[i]);
+    free(workers);
+    free(deques);
+    free(runs);
+    return ok;
+}
+
+static bool do_allocs(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    if (argc == 2 && !strcmp(argv[1], "reset")) {
+        profile_reset();
+        return true;
+    }
+    if (argc == 2 && strcmp(argv[1], "json")) {
+        report(1, "Unknown allocs mode '%s'", argv[1]);
+        return false;
+    }
+
+    if (!profile_mode)
+        report(3, "Warning: Allocation profiling is off, see option profile");
+    profile_dump(argc == 2);
+    return true;
+}
+
+static void reseed(int oldval)
+{
+    prng_seed(prng_seed_value);
+}
+
+/* A dudect round must keep some measurements after dropping both ends */
+static void check_measure(int oldval)
+{
+    if (n_measure <= 2 * drop_size) {
+        report(1, "measure must be greater than twice drop");
+        n_measure = oldval;
+    }
+}
+
+static void check_drop(int oldval)
+{
+    if (drop_size < 0 || n_measure <= 2 * drop_size) {
+        report(1, "drop must be at least 0 and less than half of measure");
+        drop_size = oldval;
+    }
+}
+
+static void check_workers(int oldval)
+{
+    if (dudect_workers < 1) {
+        report(1, "workers must be at least 1");
+        dudect_workers = oldval;
+    }
 }
 
 static void console_init()
@@ -871,23 +2264,76 @@ static void console_init()
     ADD_COMMAND(
         rhq,
         "                | Remove from head of queue without reporting value.");
+    ADD_COMMAND(drain,
+                " n              | Remove n elements from head of queue and "
+                "release them at once");
     ADD_COMMAND(reverse, "                | Reverse queue");
-    ADD_COMMAND(sort, "                | Sort queue in ascending order");
+    ADD_COMMAND(sort,
+                " [engine]       | Sort queue in ascending order, engine is "
+                "one of merge, prefix, radix or parallel (default: merge)");
     ADD_COMMAND(
         size, " [n]            | Compute queue size n times (default: n == 1)");
     ADD_COMMAND(show, "                | Show queue contents");
     ADD_COMMAND(dm, "                | Delete middle node in queue");
-    ADD_COMMAND(
-        dedup, "                | Delete all nodes that have duplicate string");
+    ADD_COMMAND(at, " i              | Show element at position i of queue");
+    ADD_COMMAND(da, " i              | Delete node at position i of queue");
+    ADD_COMMAND(use, " name           | Switch to queue name, adding it if "
+                     "needed (the first queue is named 0)");
+    ADD_COMMAND(queues, "                | List queues and their sizes");
+    ADD_COMMAND(merge,
+                "                | Merge all sorted queues into the current "
+                "one, leaving the others empty");
+    ADD_COMMAND(dedup,
+                " [hash]         | Delete all nodes that have duplicate string. "
+                "With hash, the queue does not need to be sorted");
     ADD_COMMAND(swap,
                 "                | Swap every two adjacent nodes in queue");
     ADD_COMMAND(shuffle, "                | Shuffle every nodes in queue");
+    ADD_COMMAND(load,
+                " file [pos]     | Insert every line of file, pos is head or "
+                "tail (default: tail)");
+    ADD_COMMAND(dump, " file           | Write queue to file, one string per "
+                      "line");
+    ADD_COMMAND(save, " file           | Write a binary snapshot of queue to "
+                      "file");
+    ADD_COMMAND(restore, " file           | Append the strings of a snapshot "
+                         "to queue");
+    ADD_COMMAND(mpmc,
+                " p c [n]        | Pass n strings from p producer to c consumer "
+                "threads through a lock-free queue (default: n == 1000000)");
+    ADD_COMMAND(steal,
+                " mode k [n]     | Run n tasks on k threads with work-stealing "
+                "deques, mode is light or heavy (default: n == 1000000)");
+    ADD_COMMAND(allocs,
+                " [json|reset]   | Show allocations per call site, as a table "
+                "or in JSON, or forget them");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("arena", &arena_mode,
+              "Allocate elements of new queues from an arena", NULL);
+    add_param("tail", &show_tail,
+              "Also show the last elements of queues too long to show whole",
+              NULL);
+    add_param("index", &index_mode,
+              "Keep an index in new queues for O(log n) dm, da and at", NULL);
+    add_param("threads", &sort_threads, "Number of threads for parallel sort",
+              NULL);
+    add_param("profile", &profile_mode,
+              "Record allocations per call site, see command allocs", NULL);
+    add_param("seed", &prng_seed_value, "Seed of the random number generator",
+              reseed);
+    add_param("measure", &n_measure,
+              "Number of measurements per round of simulation", check_measure);
+    add_param("drop", &drop_size,
+              "Number of measurements dropped at each end of a round",
+              check_drop);
+    add_param("workers", &dudect_workers,
+              "Number of processes measuring in simulation mode",
+              check_workers);
 }
 
 /* Signal handlers */
@@ -896,6 +2342,8 @@ static void sigsegvhandler(int sig)
     report(1,
            "Segmentation fault occurred.  You dereferenced a NULL or invalid "
            "pointer");
+    /* abort() leaves stdio buffers unwritten */
+    report_flush();
     /* Raising a SIGABRT signal to produce a core dump for debugging. */
     abort();
 }
@@ -911,6 +2359,11 @@ static void queue_init()
 {
     fail_count = 0;
     l_meta.l = NULL;
+    current = find_slot("0");
+    if (!current) {
+        fprintf(stderr, "Could not allocate the first queue slot\n");
+        exit(1);
+    }
     signal(SIGSEGV, sigsegvhandler);
     signal(SIGALRM, sigalrmhandler);
 }
@@ -918,13 +2371,21 @@ static void queue_init()
 static bool queue_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (lcnt > big_list_size)
-        set_cautious_mode(false);
-
-    if (exception_setup(true))
-        q_free(l_meta.l);
-    exception_cancel();
-    set_cautious_mode(true);
+    save_current();
+    queue_slot_t *slot, *safe;
+    list_for_each_entry_safe (slot, safe, &queue_chain, ctx.chain) {
+        if (exception_setup(true))
+            q_free(slot->ctx.q);
+        exception_cancel();
+        list_del(&slot->ctx.chain);
+        free(slot->name);
+        free(slot);
+    }
+    current = NULL;
+    l_meta.l = NULL;
+    free(show_buf);
+    show_buf = NULL;
+    show_cap = show_len = 0;
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -938,9 +2399,10 @@ static bool queue_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("Usage: %s [-h] [-c] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
+    printf("\t-c         Compile IFILE up front, then run it\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
     exit(0);
@@ -985,6 +2447,7 @@ int main(int argc, char *argv[])
     /* sanity check for git hook integration */
     if (!sanity_check())
         return -1;
+    report_buffered();
 
     /* To hold input file name */
     char buf[BUFSIZE];
@@ -992,13 +2455,17 @@ int main(int argc, char *argv[])
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
     int level = 4;
+    bool compiled = false;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hcv:f:l:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
             break;
+        case 'c':
+            compiled = true;
+            break;
         case 'f':
             strncpy(buf, optarg, BUFSIZE);
             buf[BUFSIZE - 1] = '\0';
@@ -1026,7 +2493,9 @@ int main(int argc, char *argv[])
         }
     }
 
-    srand((unsigned int) (time(NULL)));
+    /* Seeded once, so that option seed can replay every random choice */
+    prng_seed_value = (int) (random_seed() & INT_MAX);
+    prng_seed(prng_seed_value);
     queue_init();
     init_cmd();
     console_init();
@@ -1050,7 +2519,10 @@ int main(int argc, char *argv[])
     add_quit_helper(queue_quit);
 
     bool ok = true;
-    ok = ok && run_console(infile_name);
+    if (compiled && infile_name)
+        ok = ok && run_compiled(infile_name);
+    else
+        ok = ok && run_console(infile_name);
 
     /* Do finish_cmd() before check whether ok is true or false */
     ok = finish_cmd() && ok;
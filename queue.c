@@ -1,3 +1,5 @@
+#include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,35 +14,474 @@
  *   cppcheck-suppress nullPointer
  */
 
+/* How many nodes are carved out of one arena slab */
+#define ARENA_SLAB_NODES 1024
+
+/* Size of one bump region for string payloads in an arena */
+#define ARENA_STRING_CHUNK 16384
+
+/*
+ * Block of memory handed out by bumping a cursor.
+ * Chunks are chained so that the whole arena can be released at once.
+ */
+typedef struct chunk {
+    struct chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} chunk_t;
+
+struct arena;
+
+/* Element with the bookkeeping this implementation keeps per node */
+typedef struct {
+    element_t element;
+    /* Owning arena, NULL if the node was allocated on the heap */
+    struct arena *arena;
+    /*
+     * Leading bytes of the string, cached by q_sort in SORT_PREFIX mode.
+     * Other operations may use it as scratch space while they run.
+     */
+    uint64_t key;
+    /* Storage for short strings, only present in small nodes */
+    char data[];
+} node_t;
+
+/*
+ * Strings of up to INLINE_STRING_SIZE bytes, terminator included, are kept
+ * inline in a small node right behind the list linkage, which saves the
+ * separate allocation and keeps string comparisons on the node's own
+ * cache lines.
+ */
+#define INLINE_STRING_SIZE 24
+#define SMALL_NODE_SIZE (sizeof(node_t) + INLINE_STRING_SIZE)
+
+/* Memory handed over by q_arena_adopt, given back by release */
+typedef struct adopted {
+    struct adopted *next;
+    void *mem;
+    size_t size;
+    void (*release)(void *mem, size_t size);
+} adopted_t;
+
+/*
+ * Per-queue arena.  Nodes come from slabs of ARENA_SLAB_NODES small nodes
+ * and long strings are bump-allocated, so an insertion rarely reaches malloc.
+ * Released nodes are recycled through free_nodes, while string space is only
+ * reclaimed when the queue is freed, along with any adopted memory.
+ * next chains the arenas a queue took over from the queues merged into it.
+ */
+typedef struct arena {
+    chunk_t *slabs;
+    chunk_t *strings;
+    node_t *free_nodes;
+    adopted_t *adopted;
+    struct arena *next;
+} arena_t;
+
+/* Smallest number of slots an order-statistic index is built with */
+#define INDEX_MIN_SLOTS 64
+
+/*
+ * Order-statistic index of a queue, see q_index.
+ * slot[lo] to slot[hi - 1] hold the nodes in list order, with NULL holes
+ * where nodes were deleted, and count is a Fenwick tree over the occupied
+ * slots, so the i-th node is found in O(log cap) steps.  Free slots are kept
+ * at both ends for insertions; once one end fills up the index goes stale
+ * and is rebuilt from the list, with room again, on the next lookup.
+ */
+typedef struct {
+    node_t **slot;
+    int *count;
+    int cap;
+    int lo, hi;
+    bool valid;
+} index_t;
+
+/*
+ * Queue header handed out by q_new(), the list head must stay first.
+ * size is kept up to date by every queue operation that links or unlinks
+ * elements, so that q_size does not need to walk the list.
+ * sorted is only a hint that the queue was in order when last sorted or
+ * restored; q_sort checks it before relying on it, so other operations do
+ * not have to clear it.
+ * Elements merged in from other queues keep living where they were
+ * allocated: absorbed holds the arenas of those queues, and heap_nodes tells
+ * that an arena-backed queue may hold heap nodes that q_free has to release.
+ * index is NULL unless q_index was called on the queue.
+ */
+typedef struct {
+    struct list_head head;
+    arena_t *arena;
+    arena_t *absorbed;
+    int size;
+    bool sorted;
+    bool heap_nodes;
+    index_t *index;
+} queue_t;
+
+static inline queue_t *to_queue(struct list_head *head)
+{
+    return container_of(head, queue_t, head);
+}
+
+/*
+ * Take the given number of bytes from the most recent chunk in the chain,
+ * starting a new chunk of chunk_size bytes when it does not fit.
+ * Requests larger than a quarter of a chunk get a dedicated chunk placed
+ * behind the current one, so the space left in it is not wasted.
+ */
+static void *chunk_alloc(chunk_t **chain, size_t bytes, size_t chunk_size)
+{
+    chunk_t *c = *chain;
+    if (c && c->size - c->used >= bytes) {
+        void *p = c->data + c->used;
+        c->used += bytes;
+        return p;
+    }
+
+    bool dedicated = bytes > chunk_size / 4;
+    size_t size = dedicated ? bytes : chunk_size;
+    chunk_t *new = malloc(sizeof(chunk_t) + size);
+    if (!new)
+        return NULL;
+
+    new->size = size;
+    new->used = bytes;
+    if (dedicated && c) {
+        new->next = c->next;
+        c->next = new;
+    } else {
+        new->next = c;
+        *chain = new;
+    }
+    return new->data;
+}
+
+static void chunk_free_all(chunk_t *c)
+{
+    while (c) {
+        chunk_t *next = c->next;
+        free(c);
+        c = next;
+    }
+}
+
+/*
+ * Take a small node from arena a, recycling a released one if possible.
+ * reserve is passed on from node_new.
+ */
+static node_t *arena_node(arena_t *a, size_t reserve)
+{
+    node_t *node = a->free_nodes;
+    if (node) {
+        a->free_nodes = (node_t *) node->element.list.next;
+    } else {
+        size_t slab = reserve > ARENA_SLAB_NODES ? reserve : ARENA_SLAB_NODES;
+        node = chunk_alloc(&a->slabs, SMALL_NODE_SIZE, slab * SMALL_NODE_SIZE);
+    }
+    if (node)
+        node->arena = a;
+    return node;
+}
+
+/*
+ * Allocate a node holding a copy of s.
+ * Short strings are stored in the node itself, longer ones get their own
+ * block on the heap or in the arena's string region.
+ * reserve tells how many nodes, this one included, the caller is about to
+ * allocate, so that an arena can size a new slab to fit all of them.
+ * Return NULL if could not allocate space.
+ */
+static node_t *node_new(queue_t *q, const char *s, size_t reserve)
+{
+    size_t len = strlen(s) + 1;
+    bool is_inline = len <= INLINE_STRING_SIZE;
+    arena_t *a = q->arena;
+    node_t *node;
+
+    if (!a) {
+        node = malloc(is_inline ? SMALL_NODE_SIZE : sizeof(node_t));
+        if (!node)
+            return NULL;
+
+        node->arena = NULL;
+        if (is_inline) {
+            node->element.value = memcpy(node->data, s, len);
+        } else if (!(node->element.value = strdup(s))) {
+            free(node);
+            return NULL;
+        }
+        return node;
+    }
+
+    /* Arena nodes are all small, so that released ones can be reused */
+    node = arena_node(a, reserve);
+    if (!node)
+        return NULL;
+
+    char *value = is_inline
+                      ? node->data
+                      : chunk_alloc(&a->strings, len, ARENA_STRING_CHUNK);
+    if (!value) {
+        q_release_element(&node->element);
+        return NULL;
+    }
+
+    node->element.value = memcpy(value, s, len);
+    return node;
+}
+
+/* Add delta to the count of slot pos */
+static void index_add(index_t *ix, int pos, int delta)
+{
+    for (int i = pos + 1; i <= ix->cap; i += i & -i)
+        ix->count[i] += delta;
+}
+
+/* Return the slot of the node at position i, which must be in the queue */
+static int index_find(const index_t *ix, int i)
+{
+    int pos = 0;
+    for (int step = ix->cap; step; step >>= 1) {
+        if (pos + step <= ix->cap && ix->count[pos + step] <= i) {
+            pos += step;
+            i -= ix->count[pos];
+        }
+    }
+    return pos;
+}
+
+/*
+ * Lay the nodes of q out in the middle of the slots, growing them to at least
+ * twice the queue size.  Return false if the slots could not be allocated.
+ */
+static bool index_build(queue_t *q)
+{
+    index_t *ix = q->index;
+    int cap = INDEX_MIN_SLOTS;
+    while (cap < 2 * q->size + 2)
+        cap <<= 1;
+
+    if (cap > ix->cap) {
+        node_t **slot = malloc(cap * sizeof(node_t *));
+        int *count = malloc((cap + 1) * sizeof(int));
+        if (!slot || !count) {
+            free(slot);
+            free(count);
+            return false;
+        }
+        free(ix->slot);
+        free(ix->count);
+        ix->slot = slot;
+        ix->count = count;
+        ix->cap = cap;
+    }
+
+    memset(ix->slot, 0, ix->cap * sizeof(node_t *));
+    ix->lo = ix->hi = (ix->cap - q->size) / 2;
+    node_t *node;
+    list_for_each_entry (node, &q->head, element.list)
+        ix->slot[ix->hi++] = node;
+
+    /* Each count takes its own slot, then is carried into its parent */
+    ix->count[0] = 0;
+    for (int i = 1; i <= ix->cap; i++)
+        ix->count[i] = i > ix->lo && i <= ix->hi;
+    for (int i = 1; i <= ix->cap; i++) {
+        int parent = i + (i & -i);
+        if (parent <= ix->cap)
+            ix->count[parent] += ix->count[i];
+    }
+    ix->valid = true;
+    return true;
+}
+
+/* Forget the layout of q after its list was rearranged */
+static inline void index_drop(queue_t *q)
+{
+    if (q->index)
+        q->index->valid = false;
+}
+
+/* Record node as the new first or last element of q */
+static void index_push(queue_t *q, node_t *node, bool at_head)
+{
+    index_t *ix = q->index;
+    if (!ix || !ix->valid)
+        return;
+
+    if (at_head ? ix->lo == 0 : ix->hi == ix->cap) {
+        ix->valid = false;
+        return;
+    }
+    int pos = at_head ? --ix->lo : ix->hi++;
+    ix->slot[pos] = node;
+    index_add(ix, pos, 1);
+}
+
+/* Whether q has an index that is up to date, rebuilding it if need be */
+static bool index_ready(queue_t *q)
+{
+    return q->index && (q->index->valid || index_build(q));
+}
+
+/*
+ * Take the node at position i of q out of its up to date index, before the
+ * size of q drops, and return it.
+ */
+static node_t *index_take(queue_t *q, int i)
+{
+    index_t *ix = q->index;
+    int pos = index_find(ix, i);
+    node_t *node = ix->slot[pos];
+    ix->slot[pos] = NULL;
+    index_add(ix, pos, -1);
+    if (i == 0)
+        ix->lo = pos + 1;
+    else if (i == q->size - 1)
+        ix->hi = pos;
+    return node;
+}
+
+/* Return the node at position i of q, walking from the nearer end */
+static node_t *walk_to(queue_t *q, int i)
+{
+    struct list_head *node = &q->head;
+    if (i < q->size / 2) {
+        for (int k = 0; k <= i; k++)
+            node = node->next;
+    } else {
+        for (int k = q->size - i; k > 0; k--)
+            node = node->prev;
+    }
+    return list_entry(node, node_t, element.list);
+}
+
 /*
  * Create empty queue.
  * Return NULL if could not allocate space.
  */
 struct list_head *q_new()
 {
-    struct list_head *head = malloc(sizeof(struct list_head));
+    queue_t *q = malloc(sizeof(queue_t));
+    if (!q)
+        return NULL;
+
+    INIT_LIST_HEAD(&q->head);
+    q->arena = NULL;
+    q->absorbed = NULL;
+    q->size = 0;
+    q->sorted = false;
+    q->heap_nodes = false;
+    q->index = NULL;
+
+    return &q->head;
+}
+
+/*
+ * Create empty queue whose nodes and strings live in a private arena.
+ * Return NULL if could not allocate space.
+ */
+struct list_head *q_new_arena()
+{
+    struct list_head *head = q_new();
     if (!head)
         return NULL;
 
-    INIT_LIST_HEAD(head);
+    arena_t *a = malloc(sizeof(arena_t));
+    if (!a) {
+        free(to_queue(head));
+        return NULL;
+    }
+    a->slabs = NULL;
+    a->strings = NULL;
+    a->free_nodes = NULL;
+    a->adopted = NULL;
+    a->next = NULL;
+    to_queue(head)->arena = a;
 
     return head;
 }
 
+/* Release arena a with every node and string carved from it */
+static void arena_free(arena_t *a)
+{
+    chunk_free_all(a->slabs);
+    chunk_free_all(a->strings);
+    for (adopted_t *m = a->adopted, *next; m; m = next) {
+        next = m->next;
+        m->release(m->mem, m->size);
+        free(m);
+    }
+    free(a);
+}
+
 /* Free all storage used by queue */
 void q_free(struct list_head *head)
 {
     if (!head)
         return;
 
-    struct list_head *node;
-    struct list_head *safe;
+    queue_t *q = to_queue(head);
+    if (!q->arena || q->heap_nodes) {
+        struct list_head *node;
+        struct list_head *safe;
 
-    list_for_each_safe (node, safe, head) {
-        q_release_element(list_entry(node, element_t, list));
+        /* Arena nodes only go back to their arena, released right below */
+        list_for_each_safe (node, safe, head) {
+            q_release_element(list_entry(node, element_t, list));
+        }
     }
 
-    free(head);
+    /* Every other node and string lives in an arena, drop them in one go */
+    if (q->arena)
+        arena_free(q->arena);
+    for (arena_t *a = q->absorbed, *next; a; a = next) {
+        next = a->next;
+        arena_free(a);
+    }
+    if (q->index) {
+        free(q->index->slot);
+        free(q->index->count);
+        free(q->index);
+    }
+    free(q);
+}
+
+/*
+ * Keep an order-statistic index over queue, so that q_delete_mid,
+ * q_delete_at and q_at take O(log n) time.  Insertions and removals at
+ * either end keep it up to date, while operations that rearrange the queue
+ * leave it to be rebuilt in O(n) by the next positional access.
+ * Return false if could not allocate space, the queue then works as before.
+ */
+bool q_index(struct list_head *head)
+{
+    if (!head)
+        return false;
+
+    queue_t *q = to_queue(head);
+    if (q->index)
+        return true;
+
+    index_t *ix = malloc(sizeof(index_t));
+    if (!ix)
+        return false;
+    ix->slot = NULL;
+    ix->count = NULL;
+    ix->cap = 0;
+    ix->lo = ix->hi = 0;
+    ix->valid = false;
+    q->index = ix;
+    return true;
+}
+
+/* Tell queue that its list was relinked by code outside this file */
+void q_relinked(struct list_head *head)
+{
+    if (head)
+        index_drop(to_queue(head));
 }
 
 /*
@@ -55,17 +496,13 @@ bool q_insert_head(struct list_head *head, char *s)
     if (!head)
         return false;
 
-    element_t *element = malloc(sizeof(element_t));
-    if (!element)
+    node_t *node = node_new(to_queue(head), s, 1);
+    if (!node)
         return false;
 
-    element->value = strdup(s);
-    if (!element->value) {
-        free(element);
-        return false;
-    }
-
-    list_add(&element->list, head);
+    list_add(&node->element.list, head);
+    index_push(to_queue(head), node, true);
+    to_queue(head)->size++;
     return true;
 }
 
@@ -81,17 +518,118 @@ bool q_insert_tail(struct list_head *head, char *s)
     if (!head)
         return false;
 
-    element_t *element = malloc(sizeof(element_t));
-    if (!element)
+    node_t *node = node_new(to_queue(head), s, 1);
+    if (!node)
         return false;
 
-    element->value = strdup(s);
-    if (!element->value) {
-        free(element);
-        return false;
+    list_add_tail(&node->element.list, head);
+    index_push(to_queue(head), node, false);
+    to_queue(head)->size++;
+    return true;
+}
+
+/*
+ * Build a sublist of new elements for s[0] to s[n - 1] and splice it in at
+ * once, at head or at tail of the queue.  With borrow set, the elements of
+ * an arena-backed queue point at the strings instead of copying them.
+ */
+static int insert_batch(struct list_head *head,
+                        char **s,
+                        int n,
+                        bool at_head,
+                        bool borrow)
+{
+    if (!head)
+        return 0;
+
+    queue_t *q = to_queue(head);
+    borrow = borrow && q->arena;
+    LIST_HEAD(batch);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        node_t *node = borrow ? arena_node(q->arena, n - i)
+                              : node_new(q, s[i], n - i);
+        if (!node)
+            break;
+        if (borrow)
+            node->element.value = s[i];
+        index_push(q, node, at_head);
+        if (at_head)
+            list_add(&node->element.list, &batch);
+        else
+            list_add_tail(&node->element.list, &batch);
     }
 
-    list_add_tail(&element->list, head);
+    if (at_head)
+        list_splice(&batch, head);
+    else
+        list_splice_tail(&batch, head);
+    q->size += i;
+    return i;
+}
+
+/*
+ * Attempt to insert n elements at head of queue.
+ * Return the number of elements inserted.
+ */
+int q_insert_head_batch(struct list_head *head, char **s, int n)
+{
+    return insert_batch(head, s, n, true, false);
+}
+
+/*
+ * Attempt to insert n elements at tail of queue.
+ * Return the number of elements inserted.
+ */
+int q_insert_tail_batch(struct list_head *head, char **s, int n)
+{
+    return insert_batch(head, s, n, false, false);
+}
+
+/*
+ * Attempt to insert n elements at head of queue, without copying the strings
+ * if it is arena-backed.
+ * Return the number of elements inserted.
+ */
+int q_insert_head_ref(struct list_head *head, char **s, int n)
+{
+    return insert_batch(head, s, n, true, true);
+}
+
+/*
+ * Attempt to insert n elements at tail of queue, without copying the strings
+ * if it is arena-backed.
+ * Return the number of elements inserted.
+ */
+int q_insert_tail_ref(struct list_head *head, char **s, int n)
+{
+    return insert_batch(head, s, n, false, true);
+}
+
+/*
+ * Make the arena of queue responsible for size bytes at mem, to be handed to
+ * release once the queue is freed.
+ * Return false if the queue has no arena or space ran out.
+ */
+bool q_arena_adopt(struct list_head *head,
+                   void *mem,
+                   size_t size,
+                   void (*release)(void *mem, size_t size))
+{
+    if (!head || !to_queue(head)->arena)
+        return false;
+
+    adopted_t *m = malloc(sizeof(adopted_t));
+    if (!m)
+        return false;
+
+    arena_t *a = to_queue(head)->arena;
+    m->mem = mem;
+    m->size = size;
+    m->release = release;
+    m->next = a->adopted;
+    a->adopted = m;
     return true;
 }
 
@@ -114,8 +652,12 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
     if (!head || list_empty(head))
         return NULL;
 
+    queue_t *q = to_queue(head);
     element_t *element = list_first_entry(head, element_t, list);
     list_del(&element->list);
+    if (q->index && q->index->valid)
+        index_take(q, 0);
+    q->size--;
     if (sp) {
         strncpy(sp, element->value, bufsize - 1);
         sp[bufsize - 1] = '\0';
@@ -132,8 +674,12 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
     if (!head || list_empty(head))
         return NULL;
 
+    queue_t *q = to_queue(head);
     element_t *element = list_last_entry(head, element_t, list);
     list_del(&element->list);
+    if (q->index && q->index->valid)
+        index_take(q, q->size - 1);
+    q->size--;
     if (sp) {
         strncpy(sp, element->value, bufsize - 1);
         sp[bufsize - 1] = '\0';
@@ -142,13 +688,73 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 }
 
 /*
- * WARN: This is for external usage, don't modify it
- * Attempt to release element.
+ * Move the first n elements of queue to out without copying any string.
+ * The cut point is reached from whichever end of the queue is closer.
+ */
+int q_remove_head_n(struct list_head *head, int n, struct list_head *out)
+{
+    INIT_LIST_HEAD(out);
+    if (!head || n <= 0 || list_empty(head))
+        return 0;
+
+    queue_t *q = to_queue(head);
+    index_drop(q);
+    if (n >= q->size) {
+        n = q->size;
+        list_splice_init(head, out);
+        q->size = 0;
+        return n;
+    }
+
+    struct list_head *cut;
+    if (n <= q->size / 2) {
+        cut = head;
+        for (int i = 0; i < n; i++)
+            cut = cut->next;
+    } else {
+        cut = head->prev;
+        for (int i = q->size - n; i > 0; i--)
+            cut = cut->prev;
+    }
+    list_cut_position(out, head, cut);
+    q->size -= n;
+    return n;
+}
+
+/* Release every element of a list that is no longer part of a queue */
+void q_release_list(struct list_head *list)
+{
+    if (!list)
+        return;
+
+    struct list_head *node = list->next;
+    while (node != list) {
+        struct list_head *next = node->next;
+        q_release_element(list_entry(node, element_t, list));
+        node = next;
+    }
+    INIT_LIST_HEAD(list);
+}
+
+/*
+ * Attempt to release element, also used by callers on the elements they
+ * removed.  An arena node goes back on the free list of its arena, leaving
+ * its string to the arena.  A heap node is freed along with its string,
+ * unless the string is stored inline in the node.
  */
 void q_release_element(element_t *e)
 {
-    free(e->value);
-    free(e);
+    node_t *node = container_of(e, node_t, element);
+    if (node->arena) {
+        /* Keep the node for reuse, its string goes away with the arena */
+        node->element.list.next = (struct list_head *) node->arena->free_nodes;
+        node->arena->free_nodes = node;
+        return;
+    }
+
+    if (e->value != node->data)
+        free(e->value);
+    free(node);
 }
 
 /*
@@ -160,12 +766,7 @@ int q_size(struct list_head *head)
     if (!head)
         return 0;
 
-    struct list_head *node;
-    int len = 0;
-
-    list_for_each (node, head)
-        len++;
-    return len;
+    return to_queue(head)->size;
 }
 
 /*
@@ -182,6 +783,9 @@ bool q_delete_mid(struct list_head *head)
     if (!head || list_empty(head))
         return false;
 
+    if (to_queue(head)->index)
+        return q_delete_at(head, to_queue(head)->size / 2);
+
     struct list_head *forward = head;
     struct list_head *backward = head;
 
@@ -194,6 +798,40 @@ bool q_delete_mid(struct list_head *head)
 
     list_del(forward);
     q_release_element(list_entry(forward, element_t, list));
+    to_queue(head)->size--;
+    return true;
+}
+
+/*
+ * Return the element at position i of queue, counting from 0 at head.
+ * Return NULL if queue is NULL or i is out of range.
+ */
+element_t *q_at(struct list_head *head, int i)
+{
+    if (!head || i < 0 || i >= to_queue(head)->size)
+        return NULL;
+
+    queue_t *q = to_queue(head);
+    node_t *node = index_ready(q) ? q->index->slot[index_find(q->index, i)]
+                                  : walk_to(q, i);
+    return &node->element;
+}
+
+/*
+ * Delete the node at position i of queue, counting from 0 at head.
+ * Return true if successful.
+ * Return false if queue is NULL or i is out of range.
+ */
+bool q_delete_at(struct list_head *head, int i)
+{
+    if (!head || i < 0 || i >= to_queue(head)->size)
+        return false;
+
+    queue_t *q = to_queue(head);
+    node_t *node = index_ready(q) ? index_take(q, i) : walk_to(q, i);
+    list_del(&node->element.list);
+    q_release_element(&node->element);
+    q->size--;
     return true;
 }
 
@@ -212,7 +850,9 @@ bool q_delete_dup(struct list_head *head)
     if (!head)
         return false;
 
+    index_drop(to_queue(head));
     bool is_dup = false;
+    int removed = 0;
     element_t *entry;
     element_t *safe;
     struct list_head *prev = head;
@@ -220,16 +860,89 @@ bool q_delete_dup(struct list_head *head)
     list_for_each_entry_safe (entry, safe, head, list) {
         if (&safe->list != head && strcmp(entry->value, safe->value) == 0) {
             q_release_element(entry);
+            removed++;
             is_dup = true;
         } else if (is_dup) {
             is_dup = false;
             q_release_element(entry);
+            removed++;
             prev->next = &safe->list;
             safe->list.prev = prev;
         } else {
             prev = prev->next;
         }
     }
+    to_queue(head)->size -= removed;
+    return true;
+}
+
+/* Slot of the table counting strings in q_delete_dup_unsorted */
+typedef struct {
+    const char *value;
+    uint32_t hash;
+    uint32_t count;
+} dup_slot_t;
+
+/* 32-bit FNV-1a */
+static uint32_t string_hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 16777619u;
+    return h;
+}
+
+/*
+ * Delete all nodes whose string occurs more than once, in any position.
+ * The first pass counts every string in an open-addressing table and leaves
+ * the slot index of each node in its key field, so the second pass deletes
+ * the repeated ones without hashing again.  Surviving nodes keep their
+ * order.  Return false if list is NULL or the table could not be allocated.
+ */
+bool q_delete_dup_unsorted(struct list_head *head)
+{
+    if (!head)
+        return false;
+
+    queue_t *q = to_queue(head);
+    if (q->size < 2)
+        return true;
+
+    /* Keep the load factor at or below one half */
+    size_t cap = 4;
+    while (cap < 2 * (size_t) q->size)
+        cap <<= 1;
+    dup_slot_t *table = malloc(cap * sizeof(dup_slot_t));
+    if (!table)
+        return false;
+    memset(table, 0, cap * sizeof(dup_slot_t));
+
+    index_drop(q);
+    node_t *node, *safe;
+    list_for_each_entry (node, head, element.list) {
+        const char *value = node->element.value;
+        uint32_t hash = string_hash(value);
+        size_t i = hash & (cap - 1);
+        while (table[i].value &&
+               (table[i].hash != hash || strcmp(table[i].value, value) != 0))
+            i = (i + 1) & (cap - 1);
+        if (!table[i].value) {
+            table[i].value = value;
+            table[i].hash = hash;
+        }
+        table[i].count++;
+        node->key = i;
+    }
+
+    list_for_each_entry_safe (node, safe, head, element.list) {
+        if (table[node->key].count > 1) {
+            list_del(&node->element.list);
+            q_release_element(&node->element);
+            q->size--;
+        }
+    }
+
+    free(table);
     return true;
 }
 
@@ -242,6 +955,7 @@ void q_swap(struct list_head *head)
     if (!head || list_empty(head))
         return;
 
+    index_drop(to_queue(head));
     for (struct list_head *node = head->next;
          node != head && node->next != head; node = node->next) {
         struct list_head *next = node->next;
@@ -266,6 +980,7 @@ void q_reverse(struct list_head *head)
     if (!head || list_empty(head))
         return;
 
+    index_drop(to_queue(head));
     struct list_head *node = head;
     struct list_head *next = node->next;
     do {
@@ -276,17 +991,62 @@ void q_reverse(struct list_head *head)
     } while (node != head);
 }
 
-struct list_head *merge(struct list_head *a, struct list_head *b)
+/* Comparison used while merging, returns the sign of strcmp */
+typedef int (*list_cmp_func_t)(const struct list_head *,
+                               const struct list_head *);
+
+static sort_engine_t sort_engine = SORT_MERGE;
+
+static int cmp_value(const struct list_head *a, const struct list_head *b)
+{
+    return strcmp(list_entry(a, element_t, list)->value,
+                  list_entry(b, element_t, list)->value);
+}
+
+/*
+ * Compare the cached key prefixes first and only look at the strings when
+ * they are equal.  A key whose last byte is zero means the string ended
+ * within the prefix, in which case equal keys imply equal strings.
+ */
+static int cmp_key(const struct list_head *a, const struct list_head *b)
+{
+    const node_t *na = list_entry(a, node_t, element.list);
+    const node_t *nb = list_entry(b, node_t, element.list);
+
+    if (na->key != nb->key)
+        return na->key < nb->key ? -1 : 1;
+    if (!(na->key & 0xff))
+        return 0;
+    return strcmp(na->element.value + sizeof(na->key),
+                  nb->element.value + sizeof(nb->key));
+}
+
+/*
+ * Pack the first bytes of the string big-endian into an integer, padded with
+ * zeros, so that comparing two keys orders them like strcmp would.
+ */
+static uint64_t key_prefix(const char *s)
+{
+    uint64_t key = 0;
+
+    for (size_t i = 0; i < sizeof(key); i++) {
+        key <<= 8;
+        if (*s)
+            key |= (unsigned char) *s++;
+    }
+    return key;
+}
+
+struct list_head *merge(struct list_head *a,
+                        struct list_head *b,
+                        list_cmp_func_t cmp)
 {
     struct list_head head = {.next = NULL};
     struct list_head *tail = &head;
 
     while (a && b) {
-        char *sa = list_entry(a, element_t, list)->value;
-        char *sb = list_entry(b, element_t, list)->value;
-
         /* if equal, take 'a' -- important for sort stability */
-        struct list_head **smaller = strcmp(sa, sb) <= 0 ? &a : &b;
+        struct list_head **smaller = cmp(a, b) <= 0 ? &a : &b;
         tail->next = *smaller;
         tail = tail->next;
         *smaller = (*smaller)->next;
@@ -298,16 +1058,14 @@ struct list_head *merge(struct list_head *a, struct list_head *b)
 
 struct list_head *merge_final(struct list_head *head,
                               struct list_head *a,
-                              struct list_head *b)
+                              struct list_head *b,
+                              list_cmp_func_t cmp)
 {
     struct list_head *tail = head;
 
     while (a && b) {
-        char *sa = list_entry(a, element_t, list)->value;
-        char *sb = list_entry(b, element_t, list)->value;
-
         /* if equal, take 'a' -- important for sort stability */
-        struct list_head **smaller = strcmp(sa, sb) <= 0 ? &a : &b;
+        struct list_head **smaller = cmp(a, b) <= 0 ? &a : &b;
         tail->next = *smaller;
         (*smaller)->prev = tail;
         tail = tail->next;
@@ -325,43 +1083,479 @@ struct list_head *merge_final(struct list_head *head,
     return head;
 }
 
+/*
+ * Cut the natural run off the start of a NULL-terminated list and return it,
+ * storing the rest of the list in *rest.  A run is either ascending or
+ * strictly descending, in which case it is reversed on the way, so that
+ * equal elements never change their order.
+ */
+static struct list_head *take_run(struct list_head *list,
+                                  struct list_head **rest,
+                                  list_cmp_func_t cmp)
+{
+    struct list_head *next = list->next;
+
+    if (next && cmp(list, next) > 0) {
+        /* Each element taken goes in front of the previous one */
+        struct list_head *run = list;
+        run->next = NULL;
+        while (next && cmp(run, next) > 0) {
+            struct list_head *after = next->next;
+            next->next = run;
+            run = next;
+            next = after;
+        }
+        *rest = next;
+        return run;
+    }
+
+    struct list_head *last = list;
+    while (next && cmp(last, next) <= 0) {
+        last = next;
+        next = next->next;
+    }
+    last->next = NULL;
+    *rest = next;
+    return list;
+}
+
 #define SORT_BUFSIZE 32
 /*
- * Sort elements of queue in ascending order
- * No effect if q is NULL or empty. In addition, if q has only one
- * element, do nothing.
+ * Bottom-up merge sort of a NULL-terminated list.
+ * Natural runs are taken from the input as they come, and pending[i] holds
+ * a merge of 2^i of them, so piles of about the same number of runs are
+ * merged together.  Input that is already sorted or reversed forms a single
+ * run and costs a linear pass.
+ * When head is given, the final merge also rebuilds the prev links and
+ * closes the circular list around head, which is then returned.
+ * Otherwise the sorted list is returned NULL-terminated, without prev links.
  */
-void q_sort(struct list_head *head)
+static struct list_head *merge_sort(struct list_head *head,
+                                    struct list_head *list,
+                                    list_cmp_func_t cmp)
 {
     /* https://en.wikipedia.org/wiki/Merge_sort#Bottom-up_implementation_using_lists
      */
-    if (!head || head->next == head->prev)
-        return;
-
     struct list_head *pending[SORT_BUFSIZE] = {};
-    struct list_head *result = head->next;
+    struct list_head *result = list;
     struct list_head *next;
     int i;
 
-    head->prev->next = NULL;
     while (result) {
-        next = result->next;
-        result->next = NULL;
+        struct list_head *run = take_run(result, &next, cmp);
         for (i = 0; i < SORT_BUFSIZE && pending[i]; i++) {
-            result = merge(pending[i], result);
+            run = merge(pending[i], run, cmp);
             pending[i] = NULL;
         }
 
         if (i == SORT_BUFSIZE)
             i--;
-        pending[i] = result;
+        pending[i] = run;
         result = next;
     }
 
     /*merge final*/
     result = NULL;
     for (i = 0; i < SORT_BUFSIZE - 1; i++) {
-        result = merge(pending[i], result);
+        result = merge(pending[i], result, cmp);
+    }
+    if (!head)
+        return merge(pending[SORT_BUFSIZE - 1], result, cmp);
+    return merge_final(head, result, pending[SORT_BUFSIZE - 1], cmp);
+}
+
+/* Buckets holding fewer elements than this are left to merge sort */
+#define RADIX_CUTOFF 64
+
+/*
+ * Deepest byte radix sort distributes on.  Buckets still large past this
+ * point share a long prefix and are merge sorted instead, which bounds the
+ * stack used by the bucket tables.
+ */
+#define RADIX_MAX_DEPTH 32
+
+/*
+ * MSD radix sort of a NULL-terminated list whose strings all share their
+ * first depth bytes.  Elements are distributed by the byte at depth into
+ * 256 buckets by relinking them, each bucket keeping arrival order, so the
+ * sort is stable and allocates nothing.  Bucket 0 holds strings that ended
+ * and are therefore equal.
+ * Return the sorted list and store its last element in *tailp.
+ */
+static struct list_head *radix_sort(struct list_head *list,
+                                    size_t depth,
+                                    struct list_head **tailp)
+{
+    struct list_head *first[256] = {};
+    struct list_head *last[256];
+    size_t count[256] = {};
+
+    while (list) {
+        unsigned char c = list_entry(list, element_t, list)->value[depth];
+        if (first[c])
+            last[c]->next = list;
+        else
+            first[c] = list;
+        last[c] = list;
+        count[c]++;
+        list = list->next;
+    }
+
+    struct list_head *result = NULL;
+    struct list_head **link = &result;
+    struct list_head *tail = NULL;
+
+    for (int c = 0; c < 256; c++) {
+        if (!first[c])
+            continue;
+
+        last[c]->next = NULL;
+        struct list_head *sorted = first[c];
+        if (c && count[c] >= RADIX_CUTOFF && depth < RADIX_MAX_DEPTH) {
+            sorted = radix_sort(first[c], depth + 1, &tail);
+        } else {
+            if (c && count[c] > 1)
+                sorted = merge_sort(NULL, first[c], cmp_value);
+            for (tail = sorted; tail->next; tail = tail->next)
+                ;
+        }
+        *link = sorted;
+        link = &tail->next;
     }
-    merge_final(head, result, pending[SORT_BUFSIZE - 1]);
-}
\ No newline at end of file
+
+    *tailp = tail;
+    return result;
+}
+
+/* Upper bound on the number of threads SORT_PARALLEL runs */
+#define MAX_SORT_THREADS 16
+
+/*
+ * Smallest number of elements each thread should get.  Below that the
+ * cost of starting threads outweighs the work they take over.
+ */
+#define PARALLEL_MIN_CHUNK 16384
+
+static int sort_threads = 4;
+
+typedef struct {
+    pthread_t thread;
+    struct list_head *list;
+    bool started;
+} sort_worker_t;
+
+static void *sort_worker(void *arg)
+{
+    sort_worker_t *w = arg;
+    w->list = merge_sort(NULL, w->list, cmp_value);
+    return NULL;
+}
+
+/*
+ * Split the NULL-terminated list of the n elements behind head into one
+ * sublist per thread, merge sort each of them on its own thread, then merge
+ * the sorted sublists pairwise, the last merge rebuilding the circular list.
+ * Sublists stay in list order and earlier ones are passed as 'a', so the
+ * result is as stable as the sequential sort.  Nothing is allocated through
+ * the harness; the threads block all signals so that the time limit alarm
+ * is still delivered to the calling thread.
+ */
+static void parallel_sort(struct list_head *head, int n)
+{
+    sort_worker_t workers[MAX_SORT_THREADS];
+    int k = sort_threads;
+    if (k > MAX_SORT_THREADS)
+        k = MAX_SORT_THREADS;
+    if (k > n / PARALLEL_MIN_CHUNK)
+        k = n / PARALLEL_MIN_CHUNK;
+    if (k < 2) {
+        merge_sort(head, head->next, cmp_value);
+        return;
+    }
+
+    /*
+     * The calling thread holds SIGALRM back from splitting the list until it
+     * is circular again, and the workers take no signals at all: a time limit
+     * that longjmps out of the sort must leave neither threads that still
+     * relink the list nor a list in pieces behind.
+     */
+    sigset_t all, held, old;
+    sigemptyset(&held);
+    sigaddset(&held, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &held, &old);
+
+    struct list_head *node = head->next;
+    for (int i = 0; i < k; i++) {
+        int len = n / k + (i < n % k);
+        workers[i].list = node;
+        for (int j = 1; j < len; j++)
+            node = node->next;
+        struct list_head *next = node->next;
+        node->next = NULL;
+        node = next;
+    }
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &held);
+    for (int i = 1; i < k; i++)
+        workers[i].started = !pthread_create(&workers[i].thread, NULL,
+                                             sort_worker, &workers[i]);
+    pthread_sigmask(SIG_SETMASK, &held, NULL);
+
+    /* The calling thread takes the first sublist and any that failed */
+    sort_worker(&workers[0]);
+    for (int i = 1; i < k; i++) {
+        if (workers[i].started)
+            pthread_join(workers[i].thread, NULL);
+        else
+            sort_worker(&workers[i]);
+    }
+
+    for (; k > 2; k = (k + 1) / 2) {
+        for (int i = 0; i < k / 2; i++)
+            workers[i].list = merge(workers[2 * i].list,
+                                    workers[2 * i + 1].list, cmp_value);
+        if (k % 2)
+            workers[k / 2].list = workers[k - 1].list;
+    }
+    merge_final(head, workers[0].list, workers[1].list, cmp_value);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Select the algorithm used by q_sort */
+void q_sort_engine(sort_engine_t engine)
+{
+    sort_engine = engine;
+}
+
+/* Set the number of threads used by SORT_PARALLEL */
+void q_sort_threads(int threads)
+{
+    sort_threads = threads;
+}
+
+/* Hint that queue is in ascending order */
+void q_hint_sorted(struct list_head *head)
+{
+    if (head)
+        to_queue(head)->sorted = true;
+}
+
+/* Return whether the strings of queue are in ascending order */
+static bool is_sorted(struct list_head *head)
+{
+    for (struct list_head *node = head->next; node->next != head;
+         node = node->next) {
+        if (cmp_value(node, node->next) > 0)
+            return false;
+    }
+    return true;
+}
+
+/* Sort the list of a queue with at least two elements with sort_engine */
+static void sort_list(struct list_head *head)
+{
+    head->prev->next = NULL;
+    if (sort_engine == SORT_PARALLEL) {
+        parallel_sort(head, to_queue(head)->size);
+        return;
+    }
+
+    if (sort_engine == SORT_RADIX) {
+        struct list_head *tail;
+        struct list_head *prev = head;
+
+        head->next = radix_sort(head->next, 0, &tail);
+        for (struct list_head *node = head->next; node; node = node->next) {
+            node->prev = prev;
+            prev = node;
+        }
+        tail->next = head;
+        head->prev = tail;
+        return;
+    }
+
+    list_cmp_func_t cmp = cmp_value;
+    if (sort_engine == SORT_PREFIX) {
+        for (struct list_head *node = head->next; node; node = node->next) {
+            node_t *n = list_entry(node, node_t, element.list);
+            n->key = key_prefix(n->element.value);
+        }
+        cmp = cmp_key;
+    }
+
+    merge_sort(head, head->next, cmp);
+}
+
+/*
+ * Sort elements of queue in ascending order
+ * No effect if q is NULL or empty. In addition, if q has only one
+ * element, do nothing.
+ * A queue hinted or left sorted is checked in one pass first, and kept as
+ * it is if the hint holds.
+ */
+void q_sort(struct list_head *head)
+{
+    if (!head || head->next == head->prev)
+        return;
+
+    queue_t *q = to_queue(head);
+    if (!q->sorted || !is_sorted(head)) {
+        index_drop(q);
+        sort_list(head);
+    }
+    q->sorted = true;
+}
+
+/* Most queues one loser tree merges, longer chains are merged in rounds */
+#define MERGE_WAYS 64
+
+/*
+ * Loser tree over k inputs.  Input i sits below internal node (k + i) / 2,
+ * every internal node keeps the loser of the match played there and
+ * tree[0] the overall winner, so that taking the winner's next element only
+ * replays the matches on its path to the root.
+ */
+typedef struct {
+    int k;
+    int tree[MERGE_WAYS];
+    /* Next element of each input, NULL once it is drained */
+    struct list_head *cur[MERGE_WAYS];
+} loser_tree_t;
+
+/* Whether input a goes first, ties going to the earlier input */
+static bool beats(const loser_tree_t *t, int a, int b)
+{
+    if (!t->cur[a])
+        return false;
+    if (!t->cur[b])
+        return true;
+
+    int c = cmp_value(t->cur[a], t->cur[b]);
+    return c < 0 || (c == 0 && a < b);
+}
+
+/* Play the matches below node, store their losers and return the winner */
+static int loser_build(loser_tree_t *t, int node)
+{
+    if (node >= t->k)
+        return node - t->k;
+
+    int a = loser_build(t, 2 * node);
+    int b = loser_build(t, 2 * node + 1);
+    if (beats(t, a, b)) {
+        t->tree[node] = b;
+        return a;
+    }
+    t->tree[node] = a;
+    return b;
+}
+
+/* Make dst responsible for the memory of the elements src hands over */
+static void absorb(queue_t *dst, queue_t *src)
+{
+    if (src->arena) {
+        src->arena->next = dst->absorbed;
+        dst->absorbed = src->arena;
+        src->arena = NULL;
+    } else if (dst->arena) {
+        dst->heap_nodes = true;
+    }
+    dst->heap_nodes = dst->heap_nodes || src->heap_nodes;
+    src->heap_nodes = false;
+
+    while (src->absorbed) {
+        arena_t *a = src->absorbed;
+        src->absorbed = a->next;
+        a->next = dst->absorbed;
+        dst->absorbed = a;
+    }
+}
+
+/* Merge the sorted queues q[1] to q[k - 1] into q[0], leaving them empty */
+static void merge_group(queue_t **q, int k)
+{
+    loser_tree_t t = {.k = k};
+    queue_t *dst = q[0];
+
+    for (int i = 0; i < k; i++) {
+        struct list_head *head = &q[i]->head;
+        index_drop(q[i]);
+        if (list_empty(head))
+            continue;
+        head->prev->next = NULL;
+        t.cur[i] = head->next;
+        if (i) {
+            dst->size += q[i]->size;
+            q[i]->size = 0;
+            absorb(dst, q[i]);
+        }
+        INIT_LIST_HEAD(head);
+    }
+
+    struct list_head *tail = &dst->head;
+    t.tree[0] = loser_build(&t, 1);
+    for (;;) {
+        int w = t.tree[0];
+        struct list_head *node = t.cur[w];
+        if (!node)
+            break;
+
+        t.cur[w] = node->next;
+        tail->next = node;
+        node->prev = tail;
+        tail = node;
+        for (int n = (w + k) / 2; n > 0; n /= 2) {
+            if (beats(&t, t.tree[n], w)) {
+                int loser = w;
+                w = t.tree[n];
+                t.tree[n] = loser;
+            }
+        }
+        t.tree[0] = w;
+    }
+    tail->next = &dst->head;
+    dst->head.prev = tail;
+    dst->sorted = true;
+}
+
+/*
+ * Merge all the queues of the chain into the first one.
+ * Groups of up to MERGE_WAYS consecutive non-empty queues are merged into
+ * the first of them in every round, until one is left, so each element
+ * takes part in O(log k) comparisons in total.  The first queue always
+ * leads its group, which is what leaves everything in it.
+ * Return the size of the first queue.
+ */
+int q_merge(struct list_head *head)
+{
+    if (!head || list_empty(head))
+        return 0;
+
+    queue_contex_t *first = list_first_entry(head, queue_contex_t, chain);
+    if (!first->q)
+        return 0;
+
+    queue_t *group[MERGE_WAYS];
+    int left;
+    do {
+        int k = 0;
+        queue_contex_t *ctx;
+        left = 0;
+        list_for_each_entry (ctx, head, chain) {
+            if (!ctx->q || (ctx != first && list_empty(ctx->q)))
+                continue;
+            if (k == MERGE_WAYS) {
+                merge_group(group, k);
+                k = 0;
+            }
+            if (!k)
+                left++;
+            group[k++] = to_queue(ctx->q);
+        }
+        if (k > 1)
+            merge_group(group, k);
+    } while (left > 1);
+
+    return q_size(first->q);
+}
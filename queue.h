@@ -21,6 +21,14 @@ typedef struct {
     struct list_head list;
 } element_t;
 
+/* One queue in a chain of queues, as handed to q_merge */
+typedef struct {
+    struct list_head *q;
+    struct list_head chain;
+    int size;
+    int id;
+} queue_contex_t;
+
 /* Operations on queue */
 
 /*
@@ -29,12 +37,40 @@ typedef struct {
  */
 struct list_head *q_new();
 
+/*
+ * Create empty queue backed by a private arena.
+ * Elements and their strings are carved from large slabs owned by the queue,
+ * so insertions rarely reach malloc.  q_release_element hands an element back
+ * to the arena and q_free returns all of its memory at once, which means that
+ * removed elements must be released before the queue itself is freed.
+ * Return NULL if could not allocate space.
+ */
+struct list_head *q_new_arena();
+
 /*
  * Free ALL storage used by queue.
  * No effect if q is NULL
  */
 void q_free(struct list_head *head);
 
+/*
+ * Keep an order-statistic index over queue, so that q_delete_mid,
+ * q_delete_at and q_at run in O(log n) time instead of walking the list.
+ * Insertions and removals at either end keep the index up to date at a cost
+ * of O(log n) each.  Operations that rearrange the queue, such as q_sort or
+ * q_reverse, leave it to be rebuilt in O(n) by the next positional access.
+ * Return false if q is NULL or could not allocate space, in which case the
+ * queue keeps working without an index.
+ */
+bool q_index(struct list_head *head);
+
+/*
+ * Tell queue that its nodes were relinked without going through these
+ * functions, so its index no longer matches the list.
+ * No effect if q is NULL.
+ */
+void q_relinked(struct list_head *head);
+
 /*
  * Attempt to insert element at head of queue.
  * Return true if successful.
@@ -53,6 +89,53 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/*
+ * Attempt to insert n elements at head of queue.
+ * The result is the same as calling q_insert_head for s[0], s[1], ...,
+ * s[n - 1] in turn, so s[n - 1] ends up at the head, but the new elements are
+ * linked into the queue with a single splice.  Arena-backed queues also
+ * reserve node space for the whole batch at once.
+ * Return the number of elements inserted, which is less than n only when
+ * space ran out; those inserted are then the ones for the first strings.
+ * Return 0 if q is NULL.
+ */
+int q_insert_head_batch(struct list_head *head, char **s, int n);
+
+/*
+ * Attempt to insert n elements at tail of queue.
+ * The result is the same as calling q_insert_tail for s[0] to s[n - 1] in
+ * turn.  Other attribute is as same as q_insert_head_batch.
+ */
+int q_insert_tail_batch(struct list_head *head, char **s, int n);
+
+/*
+ * Attempt to insert n elements at head of queue, like q_insert_head_batch.
+ * An arena-backed queue points its new elements at s[0] to s[n - 1] instead
+ * of copying them, so the strings must stay unchanged until the queue is
+ * freed; q_arena_adopt can tie their memory to the queue.  Other queues copy
+ * the strings as usual.
+ * Return the number of elements inserted, 0 if q is NULL.
+ */
+int q_insert_head_ref(struct list_head *head, char **s, int n);
+
+/*
+ * Attempt to insert n elements at tail of queue, like q_insert_tail_batch.
+ * Strings are borrowed as in q_insert_head_ref.
+ * Return the number of elements inserted, 0 if q is NULL.
+ */
+int q_insert_tail_ref(struct list_head *head, char **s, int n);
+
+/*
+ * Hand size bytes at mem over to the arena of queue, which calls release on
+ * them when the queue is freed.
+ * Return false if q is NULL, is not arena-backed or could not allocate space,
+ * in which case the memory stays with the caller.
+ */
+bool q_arena_adopt(struct list_head *head,
+                   void *mem,
+                   size_t size,
+                   void (*release)(void *mem, size_t size));
+
 /*
  * Attempt to remove element from head of queue.
  * Return target element.
@@ -75,14 +158,33 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/*
+ * Attempt to remove the first n elements of queue at once.
+ * The removed elements are moved, in order, to the list out, which is
+ * initialized first.  Nothing is copied: ownership of the elements simply
+ * passes to the caller, who can release them with q_release_list.
+ * Return the number of elements moved, which is less than n when the queue
+ * holds fewer.  Return 0 if queue is NULL or empty.
+ */
+int q_remove_head_n(struct list_head *head, int n, struct list_head *out);
+
 /*
  * Attempt to release element.
  */
 void q_release_element(element_t *e);
 
+/*
+ * Release all elements of a list that has been detached from its queue,
+ * such as the list filled by q_remove_head_n, in a single pass.
+ * The list is left empty.  No effect if list is NULL.
+ */
+void q_release_list(struct list_head *list);
+
 /*
  * Return number of elements in queue.
  * Return 0 if q is NULL or empty
+ * The count is kept by the queue operations themselves, so this takes
+ * constant time as long as the queue is only modified through them.
  */
 int q_size(struct list_head *head);
 
@@ -98,6 +200,20 @@ int q_size(struct list_head *head);
  */
 bool q_delete_mid(struct list_head *head);
 
+/*
+ * Return the element at position i of queue using 0-based indexing, without
+ * unlinking it.
+ * Return NULL if q is NULL or i is out of range.
+ */
+element_t *q_at(struct list_head *head, int i);
+
+/*
+ * Delete the node at position i of queue using 0-based indexing.
+ * Return true if successful.
+ * Return false if q is NULL or i is out of range.
+ */
+bool q_delete_at(struct list_head *head, int i);
+
 /*
  * Delete all nodes that have duplicate string,
  * leaving only distinct strings from the original list.
@@ -108,6 +224,16 @@ bool q_delete_mid(struct list_head *head);
  */
 bool q_delete_dup(struct list_head *head);
 
+/*
+ * Delete all nodes whose string occurs more than once in the list, which
+ * does not need to be sorted.  Runs in expected linear time by counting the
+ * strings in a hash table, and keeps the order of the remaining nodes.
+ * Return true if successful.
+ * Return false if list is NULL or space for the table could not be
+ * allocated, in which case the list is left untouched.
+ */
+bool q_delete_dup_unsorted(struct list_head *head);
+
 /*
  * Attempt to swap every two adjacent nodes.
  *
@@ -124,11 +250,57 @@ void q_swap(struct list_head *head);
  */
 void q_reverse(struct list_head *head);
 
+/* Algorithms q_sort can use */
+typedef enum {
+    /* Bottom-up merge sort comparing the strings */
+    SORT_MERGE,
+    /* Merge sort comparing a cached 8-byte prefix before the strings */
+    SORT_PREFIX,
+    /* MSD radix sort on string bytes, merge sorting small buckets */
+    SORT_RADIX,
+    /* Merge sort of sublists on several threads, then merged together */
+    SORT_PARALLEL,
+} sort_engine_t;
+
+/*
+ * Select the algorithm used by subsequent calls to q_sort.
+ * Every engine is stable and only relinks the existing elements.
+ */
+void q_sort_engine(sort_engine_t engine);
+
+/*
+ * Set the number of threads SORT_PARALLEL may use.
+ * Small queues are sorted with fewer threads, down to a single one.
+ */
+void q_sort_threads(int threads);
+
 /*
  * Sort elements of queue in ascending order
  * No effect if q is NULL or empty. In addition, if q has only one
  * element, do nothing.
+ * A queue that q_sort left sorted, or that was hinted sorted, is checked in
+ * one pass first and kept as it is when already in order.
  */
 void q_sort(struct list_head *head);
 
+/*
+ * Hint that queue is already in ascending order, for example because it was
+ * restored from a snapshot of a sorted queue.  The next q_sort only checks
+ * the order in one pass, and sorts as usual if the hint turns out stale.
+ * No effect if q is NULL.
+ */
+void q_hint_sorted(struct list_head *head);
+
+/*
+ * Merge all the queues in the chain at head, each sorted in ascending
+ * order, into the first queue of the chain.  Only links are rewritten, and
+ * equal strings keep the order of their queues in the chain.  The other
+ * queues are left empty; an arena-backed one hands its arena over to the
+ * first queue and goes on allocating from the heap.  Contexts whose q is
+ * NULL are skipped, and the size fields of all of them are left for the
+ * caller to update.
+ * Return the size of the first queue, 0 if there is none.
+ */
+int q_merge(struct list_head *head);
+
 #endif /* LAB0_QUEUE_H */
@@ -1,11 +1,13 @@
 #include "random.h"
 #include <assert.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
 /* shameless stolen from ebacs */
-void randombytes(uint8_t *x, size_t how_much)
+static void urandom_read(uint8_t *x, size_t how_much)
 {
     ssize_t i;
     static int fd = -1;
@@ -37,3 +39,109 @@ void randombytes(uint8_t *x, size_t how_much)
         xlen -= i;
     }
 }
+
+/* https://prng.di.unimi.it/xoshiro256starstar.c */
+static uint64_t prng_state[4] = {
+    0x9e3779b97f4a7c15, 0xbf58476d1ce4e5b9, 0x94d049bb133111eb, 1,
+};
+
+/* Whether the state was seeded, by prng_seed or from /dev/urandom */
+static bool seeded = false;
+
+/* Generator output randombytes has yet to hand out, at the end of the buffer */
+#define RANDOM_BUF_SIZE 4096
+static uint8_t random_buf[RANDOM_BUF_SIZE];
+static size_t random_avail = 0;
+
+static inline uint64_t rotl(const uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+/* Expand the seed with splitmix64, as recommended by the xoshiro authors */
+void prng_seed(uint64_t seed)
+{
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        prng_state[i] = z ^ (z >> 31);
+    }
+    seeded = true;
+    /* Output drawn from the previous state must not leak past a reseed */
+    random_avail = 0;
+}
+
+uint64_t random_seed(void)
+{
+    uint64_t seed;
+    urandom_read((uint8_t *) &seed, sizeof(seed));
+    return seed;
+}
+
+uint64_t prng_next(void)
+{
+    if (!seeded)
+        prng_seed(random_seed());
+
+    uint64_t *s = prng_state;
+    const uint64_t result = rotl(s[1] * 5, 7) * 9;
+    const uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return result;
+}
+
+/* Reject the values of the incomplete last range to avoid modulo bias */
+uint64_t prng_below(uint64_t n)
+{
+    uint64_t limit = UINT64_MAX - UINT64_MAX % n;
+    uint64_t x;
+
+    do {
+        x = prng_next();
+    } while (x >= limit);
+    return x % n;
+}
+
+/* Fill len bytes at x, a multiple of 8, with generator output */
+static void prng_fill(uint8_t *x, size_t len)
+{
+    for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+        uint64_t r = prng_next();
+        memcpy(x + i, &r, sizeof(r));
+    }
+}
+
+/*
+ * Serve small requests from a buffer refilled a whole RANDOM_BUF_SIZE at a
+ * time, and generate large ones straight into x.
+ */
+void randombytes(uint8_t *x, size_t how_much)
+{
+    while (how_much) {
+        if (!random_avail) {
+            if (how_much >= RANDOM_BUF_SIZE) {
+                size_t bulk = how_much & ~(sizeof(uint64_t) - 1);
+                prng_fill(x, bulk);
+                x += bulk;
+                how_much -= bulk;
+                continue;
+            }
+            prng_fill(random_buf, RANDOM_BUF_SIZE);
+            random_avail = RANDOM_BUF_SIZE;
+        }
+
+        size_t n = how_much < random_avail ? how_much : random_avail;
+        memcpy(x, random_buf + RANDOM_BUF_SIZE - random_avail, n);
+        random_avail -= n;
+        x += n;
+        how_much -= n;
+    }
+}
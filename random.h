@@ -4,6 +4,10 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/*
+ * Fill x with xlen bytes from the generator below, buffered so that most
+ * calls are a copy, and reproducible once prng_seed has been called.
+ */
 void randombytes(uint8_t *x, size_t xlen);
 
 static inline uint8_t randombit(void)
@@ -13,4 +17,19 @@ static inline uint8_t randombit(void)
     return ret & 1;
 }
 
+/*
+ * Seedable pseudo-random number generator (xoshiro256**).
+ * Much faster than rand() and reproducible for a given seed; it is not
+ * meant for anything that needs unpredictable output.  Used before any
+ * prng_seed, it seeds itself once from random_seed.
+ */
+void prng_seed(uint64_t seed);
+uint64_t prng_next(void);
+
+/* Return a seed read from /dev/urandom */
+uint64_t random_seed(void);
+
+/* Return a uniformly distributed value in [0, n), n must be non-zero */
+uint64_t prng_below(uint64_t n);
+
 #endif
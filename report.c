@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -31,6 +32,7 @@ static volatile int ret = 0;
 /* Default fatal function */
 static void default_fatal_fun()
 {
+    report_flush();
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
     if (logfile)
         fputs(fail_buf, logfile);
@@ -47,9 +49,24 @@ void set_verblevel(int level)
 bool set_logfile(char *file_name)
 {
     logfile = fopen(file_name, "w");
+    if (logfile)
+        setvbuf(logfile, NULL, _IOFBF, REPORT_BUF_SIZE);
     return logfile != NULL;
 }
 
+void report_buffered()
+{
+    static char buf[REPORT_BUF_SIZE];
+    setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+}
+
+void report_flush()
+{
+    fflush(verbfile ? verbfile : stdout);
+    if (logfile)
+        fflush(logfile);
+}
+
 void report_event(message_t msg, char *fmt, ...)
 {
     va_list ap;
@@ -66,6 +83,8 @@ void report_event(message_t msg, char *fmt, ...)
     if (!errfile)
         init_files(stdout, stdout);
 
+    /* Whatever was reported so far goes out before the error */
+    report_flush();
     va_start(ap, fmt);
     fprintf(errfile, "%s: ", msg_name);
     vfprintf(errfile, fmt, ap);
@@ -99,15 +118,13 @@ void report(int level, char *fmt, ...)
         va_list ap;
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
-        fprintf(verbfile, "\n");
-        fflush(verbfile);
+        putc('\n', verbfile);
         va_end(ap);
 
         if (logfile) {
             va_start(ap, fmt);
             vfprintf(logfile, fmt, ap);
-            fprintf(logfile, "\n");
-            fflush(logfile);
+            putc('\n', logfile);
             va_end(ap);
         }
     }
@@ -122,13 +139,11 @@ void report_noreturn(int level, char *fmt, ...)
         va_list ap;
         va_start(ap, fmt);
         vfprintf(verbfile, fmt, ap);
-        fflush(verbfile);
         va_end(ap);
 
         if (logfile) {
             va_start(ap, fmt);
             vfprintf(logfile, fmt, ap);
-            fflush(logfile);
             va_end(ap);
         }
     }
@@ -142,7 +157,8 @@ static void fail_fun(char *format, char *msg)
     snprintf(fail_buf, sizeof(fail_buf), format, msg);
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
-    /* Use write to avoid any buffering issues */
+    /* Use write to avoid any buffering issues, after what is buffered */
+    report_flush();
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
 
     if (logfile) {
@@ -222,6 +238,30 @@ void *calloc_or_fail(size_t cnt, size_t bytes, char *fun_name)
     return p;
 }
 
+/* Call realloc & exit if fails, old_bytes is the current size of the block */
+void *realloc_or_fail(void *p, size_t old_bytes, size_t bytes, char *fun_name)
+{
+    if (bytes > old_bytes)
+        check_exceed(bytes - old_bytes);
+    void *q = realloc(p, bytes);
+    if (!q) {
+        fail_fun("Realloc returned NULL in %s", fun_name);
+        return NULL;
+    }
+
+    if (!p)
+        allocate_cnt++;
+    if (bytes > old_bytes)
+        allocate_bytes += bytes - old_bytes;
+    else
+        free_bytes += old_bytes - bytes;
+    current_bytes = current_bytes - old_bytes + bytes;
+    peak_bytes = MAX(peak_bytes, current_bytes);
+    last_peak_bytes = MAX(last_peak_bytes, current_bytes);
+
+    return q;
+}
+
 char *strsave_or_fail(char *s, char *fun_name)
 {
     if (!s)
@@ -274,6 +314,129 @@ void free_string(char *s)
     free_block((void *) s, strlen(s) + 1);
 }
 
+/*
+ * Allocation profiler.  Call sites are told apart by the address of their
+ * file name literal and their line, and kept in an open-addressing table.
+ * Once the table is half full, further sites are all booked on its last
+ * entry.
+ */
+#define MAX_SITES 1024
+
+typedef struct {
+    const char *file;
+    int line;
+    size_t allocs;
+    size_t frees;
+    size_t bytes;
+    size_t live_bytes;
+    size_t peak_bytes;
+} alloc_site_t;
+
+int profile_mode = 0;
+
+static alloc_site_t sites[MAX_SITES];
+static int site_cnt = 0;
+
+/* Bumped by every reset, so that blocks allocated before it are ignored */
+static int site_generation = 0;
+
+static int find_site(const char *file, int line)
+{
+    size_t h = ((size_t) file >> 3) * 31 + (size_t) line;
+    /* Keep the last entry free for the overflow site */
+    for (size_t i = 0; i < MAX_SITES - 1; i++) {
+        alloc_site_t *s = &sites[(h + i) % (MAX_SITES - 1)];
+        if (!s->file) {
+            if (site_cnt == MAX_SITES / 2)
+                break;
+            s->file = file;
+            s->line = line;
+            site_cnt++;
+            return (int) (s - sites);
+        }
+        if (s->file == file && s->line == line)
+            return (int) (s - sites);
+    }
+    return MAX_SITES - 1;
+}
+
+int profile_alloc(const char *file, int line, size_t bytes)
+{
+    if (!profile_mode)
+        return -1;
+
+    int id = find_site(file ? file : "(unknown)", line);
+    alloc_site_t *s = &sites[id];
+    s->allocs++;
+    s->bytes += bytes;
+    s->live_bytes += bytes;
+    s->peak_bytes = MAX(s->peak_bytes, s->live_bytes);
+    return site_generation * MAX_SITES + id;
+}
+
+void profile_free(int site, size_t bytes)
+{
+    if (site < 0 || site / MAX_SITES != site_generation)
+        return;
+    alloc_site_t *s = &sites[site % MAX_SITES];
+    s->frees++;
+    s->live_bytes -= bytes;
+}
+
+void profile_reset()
+{
+    memset(sites, 0, sizeof(sites));
+    site_cnt = 0;
+    site_generation = (site_generation + 1) % (INT_MAX / MAX_SITES);
+}
+
+/* Order sites by decreasing number of bytes allocated */
+static int cmp_site(const void *a, const void *b)
+{
+    const alloc_site_t *sa = *(const alloc_site_t *const *) a;
+    const alloc_site_t *sb = *(const alloc_site_t *const *) b;
+    if (sa->bytes != sb->bytes)
+        return sa->bytes < sb->bytes ? 1 : -1;
+    return sa->allocs < sb->allocs ? 1 : sa->allocs > sb->allocs ? -1 : 0;
+}
+
+void profile_dump(bool json)
+{
+    alloc_site_t *sorted[MAX_SITES];
+    int n = 0;
+    for (int i = 0; i < MAX_SITES; i++) {
+        if (sites[i].allocs)
+            sorted[n++] = &sites[i];
+    }
+    qsort(sorted, n, sizeof(alloc_site_t *), cmp_site);
+
+    if (!json)
+        report(1, "%10s %10s %12s %12s %12s  %s", "allocs", "frees", "bytes",
+               "live", "peak", "site");
+    else
+        report(1, "[");
+    for (int i = 0; i < n; i++) {
+        alloc_site_t *s = sorted[i];
+        char site[MAX_CHAR];
+        if (s == &sites[MAX_SITES - 1])
+            snprintf(site, sizeof(site), "(other)");
+        else
+            snprintf(site, sizeof(site), "%s:%d", s->file, s->line);
+
+        if (json)
+            report(1,
+                   "  {\"site\": \"%s\", \"allocs\": %zu, \"frees\": %zu, "
+                   "\"bytes\": %zu, \"live\": %zu, \"peak\": %zu}%s",
+                   site, s->allocs, s->frees, s->bytes, s->live_bytes,
+                   s->peak_bytes, i < n - 1 ? "," : "");
+        else
+            report(1, "%10zu %10zu %12zu %12zu %12zu  %s", s->allocs,
+                   s->frees, s->bytes, s->live_bytes, s->peak_bytes, site);
+    }
+    if (json)
+        report(1, "]");
+}
+
 /* Initialization of timers */
 void init_time(double *timep)
 {
@@ -17,8 +17,23 @@ typedef enum { MSG_WARN, MSG_ERROR, MSG_FATAL } message_t;
 /* Buffer sizes */
 #define MAX_CHAR 512
 
+/* Output buffered by stdout and the logfile between flushes */
+#define REPORT_BUF_SIZE (1 << 16)
+
 bool set_logfile(char *file_name);
 
+/*
+ * Buffer stdout fully, so that reports are written out in large blocks when
+ * the buffer fills up or at report_flush.  Call before anything is printed.
+ */
+void report_buffered();
+
+/*
+ * Write out everything reported so far.  Needed before waiting for input and
+ * before writing to the terminal by other means than stdio.
+ */
+void report_flush();
+
 extern int verblevel;
 void set_verblevel(int level);
 
@@ -37,10 +52,13 @@ void *malloc_or_fail(size_t bytes, char *fun_name);
 /* Attempt to call calloc.  Fail when returns NULL */
 void *calloc_or_fail(size_t cnt, size_t bytes, char *fun_name);
 
+/* Attempt to call realloc on a block of old_bytes.  Fail when returns NULL */
+void *realloc_or_fail(void *p, size_t old_bytes, size_t bytes, char *fun_name);
+
 /* Attempt to save string.  Fail when malloc returns NULL */
 char *strsave_or_fail(char *s, char *fun_name);
 
-/* Free block, as from malloc, or strsave */
+/* Free block, as from malloc, realloc, or strsave */
 void free_block(void *b, size_t len);
 
 /* Free array, as from calloc */
@@ -49,6 +67,26 @@ void free_array(void *b, size_t cnt, size_t bytes);
 /* Free string saved by strsave_or_fail */
 void free_string(char *s);
 
+/** Allocation profiler.  **/
+
+/* Whether allocations are recorded per call site */
+extern int profile_mode;
+
+/*
+ * Record an allocation of bytes made at file:line.
+ * Return the site to pass to profile_free, or -1 when not profiling.
+ */
+int profile_alloc(const char *file, int line, size_t bytes);
+
+/* Record the release of bytes allocated at site */
+void profile_free(int site, size_t bytes);
+
+/* Forget all recorded sites */
+void profile_reset();
+
+/* Show the recorded sites, heaviest first, as a table or in JSON */
+void profile_dump(bool json);
+
 /** Time measurement.  **/
 
 /* Time counted as fp number in seconds */
@@ -1,3 +1,6 @@
+#define _GNU_SOURCE /* memmem */
+#include <strings.h>
+
 #include "tiny.h"
 
 // https://developer.mozilla.org/en-US/docs/Web/HTTP/Basics_of_HTTP/MIME_types/Common_types
@@ -87,13 +90,6 @@ mime_map meme_types[] = {
 
 char *default_mime_type = "text/plain";
 
-void rio_readinitb(_rio_t *rp, int fd)
-{
-    rp->rio_fd = fd;
-    rp->rio_cnt = 0;
-    rp->rio_bufptr = rp->rio_buf;
-}
-
 ssize_t writen(int fd, void *usrbuf, size_t n)
 {
     size_t nleft = n;
@@ -114,72 +110,6 @@ ssize_t writen(int fd, void *usrbuf, size_t n)
     return n;
 }
 
-
-/*
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
- */
-/* $begin rio_read */
-static ssize_t rio_read(_rio_t *rp, char *usrbuf, size_t n)
-{
-    int cnt;
-    while (rp->rio_cnt <= 0) { /* refill if buf is empty */
-
-        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
-        if (rp->rio_cnt < 0) {
-            if (errno != EINTR) { /* interrupted by sig handler return */
-                return -1;
-            }
-        } else if (rp->rio_cnt == 0) { /* EOF */
-            return 0;
-        } else
-            rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
-    }
-
-    /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
-    cnt = n;
-    if (rp->rio_cnt < n) {
-        cnt = rp->rio_cnt;
-    }
-    memcpy(usrbuf, rp->rio_bufptr, cnt);
-    rp->rio_bufptr += cnt;
-    rp->rio_cnt -= cnt;
-    return cnt;
-}
-
-/*
- * rio_readlineb - robustly read a text line (buffered)
- */
-ssize_t rio_readlineb(_rio_t *rp, void *usrbuf, size_t maxlen)
-{
-    int n;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) {
-        int rc;
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n') {
-                break;
-            }
-        } else if (rc == 0) {
-            if (n == 1) {
-                return 0; /* EOF, no data read */
-            } else {
-                break; /* EOF, some data was read */
-            }
-        } else {
-            return -1; /* error */
-        }
-    }
-    *bufp = 0;
-    return n;
-}
-
 static const char *get_mime_type(char *filename)
 {
     char *dot = strrchr(filename, '.');
@@ -252,46 +182,6 @@ void url_decode(char *src, char *dest, int max)
     *dest = '\0';
 }
 
-void parse_request(int fd, http_request *req)
-{
-    _rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
-    req->offset = 0;
-    req->end = 0; /* default */
-
-    rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
-    /* read all */
-    while (buf[0] != '\n' && buf[1] != '\n') { /* \n || \r\n */
-        rio_readlineb(&rio, buf, MAXLINE);
-        if (buf[0] == 'R' && buf[1] == 'a' && buf[2] == 'n') {
-            sscanf(buf, "Range: bytes=%lu-%zu", &req->offset, &req->end);
-            // Range: [start, end]
-            if (req->end != 0) {
-                req->end++;
-            }
-        }
-    }
-    char *filename = uri;
-    if (uri[0] == '/') {
-        filename = uri + 1;
-        int length = strlen(filename);
-        if (length == 0) {
-            filename = ".";
-        } else {
-            int i = 0;
-            for (; i < length; ++i) {
-                if (filename[i] == '?') {
-                    filename[i] = '\0';
-                    break;
-                }
-            }
-        }
-    }
-    url_decode(filename, req->filename, MAXLINE);
-}
-
 #ifdef LOG_ACCESS
 void log_access(int status, struct sockaddr_in *c_addr, http_request *req)
 {
@@ -311,33 +201,430 @@ void client_error(int fd, int status, char *msg, char *longmsg)
     writen(fd, buf, strlen(buf));
 }
 
-char *process(int fd, struct sockaddr_in *clientaddr)
+#ifdef __linux__
+#define WEB_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+#include <poll.h>
+
+/* Largest request, pipelined ones not included, a connection may send */
+#define WEB_MAX_REQUEST (16 << 20)
+
+/* Data sent in each chunk of a batch response, and room for its framing */
+#define WEB_CHUNK_SIZE 8192
+#define WEB_CHUNK_HEAD 8
+
+/* How long to wait for a client to make room for a response, in ms */
+#define WEB_SEND_TIMEOUT 1000
+
+typedef struct {
+    int fd;
+    struct sockaddr_in addr;
+    /* Bytes received and not consumed yet, possibly several requests */
+    char *buf;
+    size_t len, cap;
+    /* Whether the request being answered lets the connection stay open */
+    bool keep_alive;
+    /* The client will not send anything more */
+    bool eof;
+    /* The response is being sent in chunks, the last sending failed */
+    bool chunked, broken;
+    /* Chunk being filled, its data starting WEB_CHUNK_HEAD bytes in */
+    char *out;
+    size_t out_len;
+} web_conn_t;
+
+static int web_listenfd = -1;
+static web_conn_t *conns[WEB_MAX_CONNS];
+/* Connection after the one that was served last */
+static int next_conn = 0;
+
+#ifdef WEB_USE_EPOLL
+static int epfd = -1;
+#endif
+
+/* Write all of buf on the non-blocking fd, waiting for room if needed */
+static bool send_all(int fd, const char *buf, size_t len)
 {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+            if ((errno != EAGAIN && errno != EWOULDBLOCK) ||
+                poll(&pfd, 1, WEB_SEND_TIMEOUT) <= 0)
+                return false;
+            continue;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void web_close(int i)
+{
+    web_conn_t *c = conns[i];
+#ifdef WEB_USE_EPOLL
+    if (!c->eof)
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+#endif
+    close(c->fd);
+    free(c->buf);
+    free(c->out);
+    free(c);
+    conns[i] = NULL;
+}
+
+/* Stop waiting for data from a client that will not send any more */
+static void web_eof(int i)
+{
+#ifdef WEB_USE_EPOLL
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conns[i]->fd, NULL);
+#endif
+    conns[i]->eof = true;
+}
+
+bool web_init(int listenfd)
+{
+    web_listenfd = listenfd;
+#ifdef WEB_USE_EPOLL
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        return false;
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = WEB_MAX_CONNS};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        close(epfd);
+        epfd = -1;
+        return false;
+    }
+#endif
+    return true;
+}
+
+int web_fdset(fd_set *readfds)
+{
+#ifdef WEB_USE_EPOLL
+    FD_SET(epfd, readfds);
+    return epfd;
+#else
+    int max = web_listenfd;
+    FD_SET(web_listenfd, readfds);
+    for (int i = 0; i < WEB_MAX_CONNS; i++) {
+        if (conns[i] && !conns[i]->eof) {
+            FD_SET(conns[i]->fd, readfds);
+            if (conns[i]->fd > max)
+                max = conns[i]->fd;
+        }
+    }
+    return max;
+#endif
+}
+
+static void web_accept()
+{
+    for (;;) {
+        struct sockaddr_in addr;
+        socklen_t addrlen = sizeof(addr);
+        int fd = accept(web_listenfd, (SA *) &addr, &addrlen);
+        if (fd < 0)
+            return;
+
+        int i = 0;
+        while (i < WEB_MAX_CONNS && conns[i])
+            i++;
+        web_conn_t *c = i < WEB_MAX_CONNS ? calloc(1, sizeof(*c)) : NULL;
+        if (!c) {
+            close(fd);
+            continue;
+        }
+
+        /* Responses are written whole, send them out right away */
+        int off = 0, on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        c->fd = fd;
+        c->addr = addr;
+#ifdef WEB_USE_EPOLL
+        struct epoll_event ev = {.events = EPOLLIN, .data.u32 = i};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            free(c);
+            continue;
+        }
+#endif
+        conns[i] = c;
 #ifdef LOG_ACCESS
-    printf("accept request, fd is %d, pid is %d\n", fd, getpid());
+        printf("accept request, fd is %d, pid is %d\n", fd, getpid());
 #endif
-    http_request req;
-    parse_request(fd, &req);
-    int status = 200;
-
-    char *p = req.filename;
-    /* Change '/' to ' ' */
-    if (p) {
-        while ((*p) != '\0') {
-            ++p;
-            if (*p == '/') {
-                *p = ' ';
+    }
+}
+
+static void web_read(int i)
+{
+    web_conn_t *c = conns[i];
+    for (;;) {
+        if (c->len == c->cap) {
+            if (c->cap >= 2 * WEB_MAX_REQUEST) {
+                /* Not consuming fast enough, wait until it has been */
+                return;
             }
+            size_t cap = c->cap ? 2 * c->cap : _RIO_BUFSIZE;
+            char *buf = realloc(c->buf, cap);
+            if (!buf) {
+                web_close(i);
+                return;
+            }
+            c->buf = buf;
+            c->cap = cap;
+        }
+
+        ssize_t n = read(c->fd, c->buf + c->len, c->cap - c->len);
+        if (n > 0) {
+            c->len += n;
+        } else if (n == 0) {
+            web_eof(i);
+            return;
+        } else if (errno != EINTR) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                web_eof(i);
+            return;
         }
     }
-    client_error(fd, status, "", "");
+}
+
+void web_poll(fd_set *readfds)
+{
+#ifdef WEB_USE_EPOLL
+    if (!FD_ISSET(epfd, readfds))
+        return;
+    FD_CLR(epfd, readfds);
+
+    struct epoll_event evs[64];
+    int n = epoll_wait(epfd, evs, 64, 0);
+    for (int k = 0; k < n; k++) {
+        uint32_t i = evs[k].data.u32;
+        if (i == WEB_MAX_CONNS)
+            web_accept();
+        else if (conns[i])
+            web_read(i);
+    }
+#else
+    if (FD_ISSET(web_listenfd, readfds)) {
+        FD_CLR(web_listenfd, readfds);
+        web_accept();
+    }
+    for (int i = 0; i < WEB_MAX_CONNS; i++) {
+        if (conns[i] && !conns[i]->eof && FD_ISSET(conns[i]->fd, readfds)) {
+            FD_CLR(conns[i]->fd, readfds);
+            web_read(i);
+        }
+    }
+#endif
+}
+
+/* Return the value of header name in the header block hdr, or NULL */
+static const char *find_header(const char *hdr, const char *name)
+{
+    size_t len = strlen(name);
+    for (const char *line = hdr; line; line = strchr(line, '\n')) {
+        if (*line == '\n')
+            line++;
+        if (!strncasecmp(line, name, len) && line[len] == ':') {
+            line += len + 1;
+            while (*line == ' ' || *line == '\t')
+                line++;
+            return line;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Return the length of the complete request at the start of the buffer of
+ * c, or 0 if it has not been received in full yet.  The head of the request
+ * ends at offset *head_end and its body starts at *body.
+ */
+static size_t request_length(web_conn_t *c, size_t *head_end, size_t *body)
+{
+    char *end = memmem(c->buf, c->len, "\r\n\r\n", 4);
+    size_t sep = 4;
+    char *lf = memmem(c->buf, c->len, "\n\n", 2);
+    if (!end || (lf && lf < end)) {
+        end = lf;
+        sep = 2;
+    }
+    if (!end)
+        return 0;
+
+    *end = '\0';
+    const char *clen = find_header(c->buf, "Content-Length");
+    *end = sep == 4 ? '\r' : '\n';
+    size_t body_len = clen ? strtoul(clen, NULL, 10) : 0;
+
+    *head_end = end - c->buf;
+    *body = *head_end + sep;
+    if (c->len - *body < body_len)
+        return 0;
+    return *body + body_len;
+}
+
+bool web_pending()
+{
+    size_t head_end, body;
+    for (int i = 0; i < WEB_MAX_CONNS; i++) {
+        if (conns[i] && request_length(conns[i], &head_end, &body))
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Turn the URI of the request line into a command, '/' separating words.
+ * A POST to /batch instead returns its body, one command per line.
+ */
+static char *request_command(web_conn_t *c, size_t body, size_t len,
+                             bool *batch)
+{
+    char method[MAXLINE], uri[MAXLINE], version[MAXLINE] = "HTTP/1.0";
+    if (sscanf(c->buf, "%1023s %1023s %1023s", method, uri, version) < 2)
+        return NULL;
+
+    const char *conn = find_header(c->buf, "Connection");
+    if (!strncmp(version, "HTTP/1.1", 8))
+        c->keep_alive = !conn || strncasecmp(conn, "close", 5);
+    else
+        c->keep_alive = conn && !strncasecmp(conn, "keep-alive", 10);
+
+    char *path = uri[0] == '/' ? uri + 1 : uri;
+    char *query = strchr(path, '?');
+    if (query)
+        *query = '\0';
+
+    http_request req;
+    url_decode(path, req.filename, sizeof(req.filename));
+    for (char *p = req.filename; *p; p++) {
+        if (*p == '/')
+            *p = ' ';
+    }
 #ifdef LOG_ACCESS
-    log_access(status, clientaddr, &req);
+    log_access(200, &c->addr, &req);
 #endif
-    char *ret = malloc(strlen(req.filename) + 1);
-    strncpy(ret, req.filename, strlen(req.filename) + 1);
+    *batch = !strcmp(method, "POST") && !strcmp(req.filename, "batch");
+    if (*batch)
+        return strndup(c->buf + body, len - body);
+    return strdup(req.filename);
+}
+
+char *web_next(int *conn, bool *batch)
+{
+    for (int k = 0; k < WEB_MAX_CONNS; k++) {
+        int i = (next_conn + k) % WEB_MAX_CONNS;
+        web_conn_t *c = conns[i];
+        if (!c)
+            continue;
+
+        size_t head_end, body, len = request_length(c, &head_end, &body);
+        if (!len) {
+            /* Nothing more will complete the pending bytes */
+            if (c->eof || c->len >= WEB_MAX_REQUEST)
+                web_close(i);
+            continue;
+        }
+
+        c->buf[head_end] = '\0';
+        char *cmd = request_command(c, body, len, batch);
+        memmove(c->buf, c->buf + len, c->len - len);
+        c->len -= len;
+        if (!cmd) {
+            client_error(c->fd, 400, "Bad Request", "");
+            web_close(i);
+            continue;
+        }
+
+        next_conn = (i + 1) % WEB_MAX_CONNS;
+        *conn = i;
+        return cmd;
+    }
+    return NULL;
+}
+
+/* Send the data gathered in the chunk buffer of c as one chunk */
+static void flush_chunk(web_conn_t *c)
+{
+    if (!c->out_len || c->broken)
+        return;
 
-    return ret;
+    char head[WEB_CHUNK_HEAD + 1];
+    int n = snprintf(head, sizeof(head), "%zx\r\n", c->out_len);
+    char *start = c->out + WEB_CHUNK_HEAD - n;
+    memcpy(start, head, n);
+    memcpy(c->out + WEB_CHUNK_HEAD + c->out_len, "\r\n", 2);
+    if (!send_all(c->fd, start, n + c->out_len + 2))
+        c->broken = true;
+    c->out_len = 0;
+}
+
+void web_begin_chunked(int conn)
+{
+    web_conn_t *c = conns[conn];
+    if (!c->out) {
+        c->out = malloc(WEB_CHUNK_HEAD + WEB_CHUNK_SIZE + 2);
+        if (!c->out) {
+            c->broken = true;
+            return;
+        }
+    }
+
+    char buf[MAXLINE];
+    int len = snprintf(buf, sizeof(buf),
+                       "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                       "Transfer-Encoding: chunked\r\nConnection: %s\r\n\r\n",
+                       c->keep_alive ? "keep-alive" : "close");
+    c->chunked = true;
+    c->broken = !send_all(c->fd, buf, len);
+    c->out_len = 0;
+}
+
+void web_write(int conn, const char *data, size_t len)
+{
+    web_conn_t *c = conns[conn];
+    while (len > 0 && !c->broken) {
+        size_t n = WEB_CHUNK_SIZE - c->out_len;
+        if (n > len)
+            n = len;
+        memcpy(c->out + WEB_CHUNK_HEAD + c->out_len, data, n);
+        c->out_len += n;
+        data += n;
+        len -= n;
+        if (c->out_len == WEB_CHUNK_SIZE)
+            flush_chunk(c);
+    }
+}
+
+void web_respond(int conn)
+{
+    web_conn_t *c = conns[conn];
+    if (!c)
+        return;
+
+    if (c->chunked) {
+        flush_chunk(c);
+        c->chunked = false;
+        if (c->broken || !send_all(c->fd, "0\r\n\r\n", 5) || !c->keep_alive)
+            web_close(conn);
+        return;
+    }
+
+    char buf[MAXLINE];
+    int len = snprintf(buf, sizeof(buf),
+                       "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n"
+                       "Connection: %s\r\n\r\n",
+                       c->keep_alive ? "keep-alive" : "close");
+    if (!send_all(c->fd, buf, len) || !c->keep_alive)
+        web_close(conn);
 }
 
 /*void print_help()
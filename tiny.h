@@ -8,9 +8,11 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/select.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -34,13 +36,6 @@
 #define LOG_ACCESS
 #endif
 
-typedef struct {
-    int rio_fd;                 /* descriptor for this buf */
-    int rio_cnt;                /* unread byte in this buf */
-    char *rio_bufptr;           /* next unread byte in this buf */
-    char rio_buf[_RIO_BUFSIZE]; /* internal buffer */
-} _rio_t;
-
 /* Simplifies calls to bind(), connect(), and accept() */
 typedef struct sockaddr SA;
 
@@ -55,15 +50,8 @@ typedef struct {
     const char *mime_type;
 } mime_map;
 
-void rio_readinitb(_rio_t *rp, int fd);
-
 ssize_t writen(int fd, void *usrbuf, size_t n);
 
-/*
- * rio_readlineb - robustly read a text line (buffered)
- */
-ssize_t rio_readlineb(_rio_t *rp, void *usrbuf, size_t maxlen);
-
 // void format_size(char *buf, struct stat *stat);
 
 // void handle_directory_request(int out_fd, int dir_fd, char *filename);
@@ -73,8 +61,6 @@ int open_listenfd(int port);
 
 void url_decode(char *src, char *dest, int max);
 
-void parse_request(int fd, http_request *req);
-
 #ifdef LOG_ACCESS
 void log_access(int status, struct sockaddr_in *c_addr, http_request *req);
 #endif
@@ -84,7 +70,45 @@ void client_error(int fd, int status, char *msg, char *longmsg);
 // void serve_static(int out_fd, int in_fd, http_request *req, size_t
 // total_size);
 
-char *process(int fd, struct sockaddr_in *clientaddr);
+/*
+ * Event loop serving many keep-alive connections at once.  Requests may be
+ * pipelined; each one carries a command in its URI, and gets its response
+ * once the command has been interpreted.  Uses epoll where available and
+ * select otherwise.
+ */
+
+/* Most connections kept open at the same time */
+#define WEB_MAX_CONNS 1000
+
+/* Start accepting connections on the non-blocking socket listenfd */
+bool web_init(int listenfd);
+
+/* Add the descriptors to wait on to readfds, return the largest one */
+int web_fdset(fd_set *readfds);
+
+/* Accept connections and read requests from whatever readfds says is ready */
+void web_poll(fd_set *readfds);
+
+/* Return whether a complete request is waiting to be taken */
+bool web_pending();
+
+/*
+ * Take the command of the next complete request, visiting connections in
+ * turn so that none of them can starve the others.  Store the connection in
+ * *conn, to be passed to web_respond.  A POST to /batch sets *batch and
+ * returns the body of the request, one command per line.
+ * Return NULL if there is none, the caller frees the command with free.
+ */
+char *web_next(int *conn, bool *batch);
+
+/* Answer the request taken from conn with a chunked response */
+void web_begin_chunked(int conn);
+
+/* Add len bytes of data to the chunked response being sent on conn */
+void web_write(int conn, const char *data, size_t len);
+
+/* Finish answering the request last taken from conn, closing it if asked */
+void web_respond(int conn);
 
 // void print_help();
 #endif
\ No newline at end of file
@@ -0,0 +1,115 @@
+#include "wsdeque.h"
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/*
+ * The orderings follow "Correct and Efficient Work-Stealing for Weak Memory
+ * Models" by Le, Pop, Cohen and Zappa Nardelli.  The owner moves bottom
+ * freely; top only ever grows, through a compare-and-swap by whoever takes
+ * the item at top.  The owner only races with thieves for the last item,
+ * which it settles with the same compare-and-swap.  The deque never grows,
+ * so a thief reading a slot is never concurrent with the owner freeing it.
+ */
+
+#define CACHE_LINE 64
+
+struct wsdeque {
+    /* Keep the ends on their own cache lines, thieves only write top */
+    _Alignas(CACHE_LINE) atomic_long top;
+    _Alignas(CACHE_LINE) atomic_long bottom;
+    _Alignas(CACHE_LINE) long mask;
+    _Atomic(void *) *items;
+};
+
+wsdeque_t *wsdeque_new(size_t capacity)
+{
+    size_t cap = 1;
+    while (cap < capacity) {
+        if (cap > LONG_MAX / 2 / sizeof(void *))
+            return NULL;
+        cap <<= 1;
+    }
+
+    wsdeque_t *d = aligned_alloc(CACHE_LINE, sizeof(wsdeque_t));
+    if (!d)
+        return NULL;
+    d->items = malloc(cap * sizeof(*d->items));
+    if (!d->items) {
+        free(d);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < cap; i++)
+        atomic_init(&d->items[i], NULL);
+    d->mask = (long) cap - 1;
+    atomic_init(&d->top, 0);
+    atomic_init(&d->bottom, 0);
+    return d;
+}
+
+void wsdeque_free(wsdeque_t *d)
+{
+    if (!d)
+        return;
+    free(d->items);
+    free(d);
+}
+
+bool wsdeque_push(wsdeque_t *d, void *item)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t > d->mask)
+        return false;
+
+    atomic_store_explicit(&d->items[b & d->mask], item, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+void *wsdeque_pop(wsdeque_t *d)
+{
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    /* Make the claim on b visible before looking at what thieves took */
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (t > b) {
+        /* Empty, undo the claim */
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    void *item =
+        atomic_load_explicit(&d->items[b & d->mask], memory_order_relaxed);
+    if (t == b) {
+        /* Last item, thieves may be after it too */
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed))
+            item = NULL;
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+void *wsdeque_steal(wsdeque_t *d)
+{
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b)
+        return NULL;
+
+    void *item =
+        atomic_load_explicit(&d->items[t & d->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed))
+        return NULL;
+    return item;
+}
@@ -0,0 +1,48 @@
+#ifndef LAB0_WSDEQUE_H
+#define LAB0_WSDEQUE_H
+
+/*
+ * Bounded Chase-Lev work-stealing deque.
+ *
+ * Each deque has one owner thread, which pushes and pops items at the
+ * bottom end like a stack.  Any other thread may steal items from the top
+ * end, so an idle worker takes the oldest work of a busy one.  Items are
+ * opaque non-NULL pointers; memory comes straight from malloc since the
+ * allocator of the harness is not thread-safe.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct wsdeque wsdeque_t;
+
+/*
+ * Create a deque holding at least capacity items; capacity is rounded up to
+ * a power of two.
+ * Return NULL if could not allocate space.
+ */
+wsdeque_t *wsdeque_new(size_t capacity);
+
+/* Free all storage used by the deque, no other thread may still use it */
+void wsdeque_free(wsdeque_t *d);
+
+/*
+ * Push item at the bottom of the deque, only the owner may call this.
+ * Return true if successful, false if the deque is full.
+ */
+bool wsdeque_push(wsdeque_t *d, void *item);
+
+/*
+ * Pop the item at the bottom of the deque, only the owner may call this.
+ * Return NULL if the deque is empty.
+ */
+void *wsdeque_pop(wsdeque_t *d);
+
+/*
+ * Steal the item at the top of the deque, any thread may call this.
+ * Return NULL if the deque is empty or another thread took the item first;
+ * in the latter case the caller may simply try again.
+ */
+void *wsdeque_steal(wsdeque_t *d);
+
+#endif /* LAB0_WSDEQUE_H */